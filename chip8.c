@@ -1,13 +1,49 @@
+#define _POSIX_C_SOURCE 200809L // shm_open/mmap with -std=c17
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 fills for the software rasterizer
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
 
 //#define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
 
+#include "chip8_shm.h" // Shared memory export layout
+
+#ifdef CHIP8_LIBRARY
+#include "chip8_env.h" // Batched environment API, no main()
+#endif
+
+#ifdef CHIP8_FUZZ
+int LLVMFuzzerInitialize(int *argc, char ***argv); // Fuzz target, no main()
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+void fuzz_trace(const uint16_t opcode);
+#define FUZZ_TRACE(chip8) fuzz_trace((chip8)->inst.opcode) // Opcode coverage from the plain interpreters
+#else
+#define FUZZ_TRACE(chip8)
+#endif
+
 // SDL Container object
 typedef struct {
     SDL_Window *window;
@@ -30,6 +66,24 @@ typedef enum {
     XOCHIP,
 } extension_t;
 
+// CHIP8 quirk flags, the interpreter is instantiated once per combination
+#define QUIRK_VF_RESET      (1 << 0) // 8XY1/8XY2/8XY3 reset VF to 0
+#define QUIRK_SHIFT_VY      (1 << 1) // 8XY6/8XYE shift VY into VX, instead of VX in place
+#define QUIRK_MEMORY_INC_I  (1 << 2) // FX55/FX65 leave I incremented past the last register
+#define QUIRK_DISPLAY_WAIT  (1 << 3) // DXYN waits for vblank, at most one sprite drawn per frame
+#define QUIRK_COUNT 4
+
+#define ALWAYS_INLINE __attribute__((always_inline))
+
+// Software rasterizer filters, applied on top of integer scaling
+typedef enum {
+    FILTER_NONE,
+    FILTER_SCANLINES, // Darken every other output row, CRT style
+    FILTER_SCALE2X,   // Scale2x/EPX edge smoothing, needs an even scale
+} raster_filter_t;
+
+#define MAX_SESSIONS 64 // Most ROMs one process hosts, see run_host()
+
 // Emulator configuration object
 typedef struct {
     uint32_t window_width; // SDL window width
@@ -43,7 +97,36 @@ typedef struct {
     uint16_t volume; // How loud or not is the sound
     uint32_t audio_sample_rate;
     float color_lerp_rate; // Amount to lerp colors by, between [0.1, 1.0]
+    SDL_Keycode keymap[16]; // Host key for each CHIP8 key 0x0-0xF
     extension_t current_extension; // Current CHIP8 extension in use
+    uint32_t quirks; // QUIRK_* flags, from current_extension unless --quirks is given
+    bool vip_timing; // Pace frames by COSMAC VIP cycle costs instead of insts_per_second
+    bool fusion; // Run common instruction sequences as fused operations
+    bool headless; // Run without SDL window/audio, as fast as possible
+    uint32_t max_frames; // Stop after this many 60hz frames, 0 = run until quit
+    const char *capture_file; // Record frames to this file (.y4m, .rgba or .gif), NULL = off
+    uint32_t capture_scale; // Software rasterizer scale for captured frames
+    raster_filter_t raster_filter; // Filter for software rendered captures/screenshots
+    const char *screenshot_file; // Save last frame to this file (.ppm or .pam) on exit, NULL = off
+    const char *analysis_file; // Write static ROM analysis here at load (.dot graph or text report), NULL = off
+    uint32_t run_ahead_frames; // Frames to speculatively emulate ahead of input, 0 = off
+    uint32_t input_slices; // Times per frame input is polled, between instruction slices
+    bool latency_stats; // Measure key press to changed frame latency, report on exit
+    uint32_t max_skip; // Most presents dropped in a row when rendering is behind, 0 = never drop
+    bool hud; // Start with the performance overlay shown, F1 toggles it
+    const char *metrics_file; // Write one line of metrics per interval here, "-" = stdout, NULL = off
+    uint32_t metrics_interval; // Metrics interval in ms, also how often the HUD and window title update
+    bool trap_violations; // Stop at the end of a frame with a memory safety violation
+    const char *shm_name; // Publish frames/state to this POSIX shared memory name, NULL = off
+    bool monitor; // Interactive debugger monitor on stdin
+    uint16_t gdb_port; // GDB remote stub on this localhost TCP port, 0 = off
+    const char *profile_db; // ROM profile database, NULL = don't look up profiles
+    bool profile_db_given; // profile_db came from --profiles, so it must exist
+    const char *save_profile; // Save this run's options as the ROM's profile in this database, NULL = off
+    const char *session_roms[MAX_SESSIONS - 1]; // ROMs hosted next to the first one, tiled into one window
+    uint32_t num_sessions; // Entries in session_roms, 0 = normal single machine run
+    uint32_t threads; // Threads stepping hosted sessions, 0 = one per CPU
+    bool route_keymap; // Hosted sessions all take input through their own keymaps, instead of only the focused one
 } config_t;
 
 // CHIP8 Instructions format
@@ -56,25 +139,299 @@ typedef struct {
     uint8_t Y; // 4 bit register identifier
 } instruction_t;
 
-// CHIP8 Machine Object
+// Address and stack masks for the hardened access helpers, see ram_span()
+#define RAM_MASK 0xFFF // 4KB RAM, addresses wrap
+#define RAM_GUARD 16 // Bytes past the end of RAM that a multi-byte access (at most 16 bytes) may run into
+#define STACK_DEPTH 16 // Subroutine stack entries, a ring indexed by sp & STACK_MASK
+#define STACK_MASK (STACK_DEPTH - 1)
+#define SP_MASK (2 * STACK_DEPTH - 1) // sp keeps one extra bit so a full stack differs from an empty one
+
+// Memory safety violations; counted branch-free and masked into range, never trapped mid-instruction
+typedef struct {
+    uint32_t ram; // Accesses past RAM_MASK, wrapped or run into the guard area
+    uint32_t stack_overflow; // 2NNN with STACK_DEPTH or more entries pushed, oldest entry overwritten
+    uint32_t stack_underflow; // 00EE with an empty stack
+    uint32_t keypad; // EX9E/EXA1 with VX > 0xF, masked to 4 bits
+} violations_t;
+
+// Macro-op fusion, common instruction sequences run as one operation, see build_fusion()
+#define FUSE_LOAD_DRAW  1 // ANNN, DXYN
+#define FUSE_SET_CHAIN  2 // Run of 6XNN/7XNN, its length in the high nibble
+#define FUSE_SKIP_JUMP  3 // 3XNN/4XNN, 1NNN
+#define FUSE_INDEX_LOAD 4 // FX1E, FY65
+#define FUSE_DELAY_POLL 5 // FX07, 3X00, 1NNN back to the FX07
+#define FUSE_KIND_MASK 0x0F
+#define FUSE_MAX_CHAIN 8 // Most 6XNN/7XNN in one fused run
+#define FUSE_WINDOW (2 * FUSE_MAX_CHAIN) // Most bytes a fused operation reads
+#define FUSE_LINE 16 // Bytes per fused_lines bit
+#define FUSE_LINES ((RAM_MASK + 1) / FUSE_LINE)
+
+#define CACHE_LINE 64 // Machine slots and the hot CPU state they start with are aligned to this
+
+// Pristine state of one ROM under one set of quirks, built once by
+// load_rom_image() and shared read only by every machine running it
+typedef struct {
+    uint8_t ram[RAM_MASK + 1 + RAM_GUARD]; // Font and ROM as loaded, what a reset starts from
+    uint8_t fused[RAM_MASK + 1 + RAM_GUARD]; // FUSE_* operation starting at each address, 0 = none
+    uint8_t fused_lines[FUSE_LINES / 8]; // FUSE_LINE byte lines read by a fused operation
+    uint64_t hash; // FNV-1a of the ROM image, keys the profile database
+    size_t rom_size;
+    uint32_t quirks; // Quirks the fusion analysis assumed
+    bool fusion; // fused was built, without config->fusion it stays all 0
+} rom_image_t;
+
+// CHIP8 Machine Object. Hot CPU state comes first and fills two cache lines,
+// then RAM and the display, then pointers to what the machine shares or does
+// not always need. Copying a machine is a plain memcpy.
 typedef struct {
-    emulator_state_t state;
-    uint8_t ram[4096];
-    bool display[64*32]; // Emulate original CHIP8 pixels
-    uint32_t pixel_color[64*32]; // CHIP8 pixels color to draw
-    uint16_t stack[12]; // Subroutine stack
-    uint16_t *stack_ptr;
-    uint8_t V[16]; // Data registers V0-VF
-    uint16_t I; // Index registers
     uint16_t PC; // Program counter
+    uint16_t I; // Index registers
+    uint8_t V[16]; // Data registers V0-VF
+    uint16_t stack[STACK_DEPTH]; // Subroutine stack
+    uint8_t sp; // Stack depth, mod 2 * STACK_DEPTH
     uint8_t delay_timer; // Decrement at 60hz when >0
     uint8_t sound_timer; // Decrement at 60hz and plays tone when >0
+    uint8_t wait_key; // FX0A: key pressed and waiting to be released, 0xFF = none yet
+    bool draw; // Update the screen yes/no
+    bool vblank_wait; // DXYN drew with QUIRK_DISPLAY_WAIT, idle until the next timer tick
+    emulator_state_t state;
+    uint32_t rng; // CXNN random state, part of the machine so runs are reproducible
+    instruction_t inst;  // Currently executing instruction
+    uint64_t cycles; // COSMAC VIP machine cycles run, only counted with vip_timing
+    const uint8_t *fused; // The image's fused operations, see fuse_stale()
     bool keypad[16]; // Hexadecimal keypad 0x0-0xF
+    violations_t violations; // Out of range RAM/stack/keypad accesses so far
+    uint8_t fused_stale[(RAM_MASK + 1) / 8]; // Bit per address, its fused operation read RAM written since reset
+    uint8_t ram[RAM_MASK + 1 + RAM_GUARD]; // 4KB plus the guard area, see ram_span()
+    uint64_t display[32]; // Emulate original CHIP8 pixels, a row per word, pixel x is bit 63 - x
+    const rom_image_t *image; // ROM this machine was reset to
+    uint32_t *pixel_color; // 64*32 CHIP8 pixels color to draw, NULL for machines that are never drawn
     const char *rom_name; // Currently running ROM
-    instruction_t inst;  // Currently executing instruction
-    bool draw; // Update the screen yes/no
 } chip8_t;
 
+// Fixed size machine slots in one cache line aligned block, handed out in
+// order and released together
+typedef struct {
+    void *block; // As allocated, before alignment
+    uint8_t *slots; // First slot, CACHE_LINE aligned
+    size_t stride; // sizeof(chip8_t) rounded up to CACHE_LINE
+    uint32_t capacity;
+    uint32_t used;
+} machine_arena_t;
+
+// Quirk specialized interpreter, emulates up to count instructions and
+// returns the number run, fewer when a display wait ends the frame
+typedef uint32_t (*interpreter_t)(chip8_t *chip8, const config_t *config, const uint32_t count);
+
+// COSMAC VIP timing model: a 1.76 MHz CDP1802 at 8 clocks per machine cycle
+#define VIP_CYCLES_PER_FRAME 3668 // Machine cycles per 60hz frame
+#define VIP_DISPLAY_CYCLES 1100 // Of those, taken by display DMA (128 lines x 8 bytes) and the vblank interrupt
+
+// Quirk specialized interpreter on the VIP cycle clock, emulates until chip8->cycles
+// reaches until and returns the number of instructions run
+typedef uint32_t (*cycle_interpreter_t)(chip8_t *chip8, const config_t *config, const uint64_t until);
+
+// Run-ahead state, a speculative copy of the machine emulated ahead of input
+typedef struct {
+    chip8_t ahead; // Speculative machine, run_ahead_frames ahead of the real one
+    bool valid; // ahead is still consistent with the real machine and its input
+    uint64_t rollbacks; // Times ahead was rebuilt from the real machine
+} runahead_t;
+
+// Shared memory export object, layout in chip8_shm.h
+typedef struct {
+    chip8_shm_t *shm; // Mapped segment
+    const char *name;
+    uint32_t input_seq; // Last reader input_seq copied into the keypad
+} shm_export_t;
+
+#define LATENCY_BUCKETS 500 // 0.5 ms histogram buckets, up to 250 ms
+
+// Input to photon latency measurement
+typedef struct {
+    uint64_t pending_since; // Perf counter time of oldest unanswered keypad event, 0 = none
+    uint64_t last_display[32]; // Display of the last presented frame
+    uint64_t samples;
+    double total_ms, min_ms, max_ms;
+    uint32_t histogram[LATENCY_BUCKETS]; // Last bucket also counts anything slower
+} latency_t;
+
+// Frame pacing, game time advances exactly one 60hz frame per emulated frame
+// and presents are dropped while the renderer is behind
+typedef struct {
+    uint64_t period; // Perf counter ticks per 60hz frame
+    uint64_t deadline; // Perf counter time the current frame should be done by
+    uint32_t skip_run; // Presents dropped in a row
+    uint64_t presented, skipped; // Frames presented/dropped
+    uint32_t longest_run; // Most presents dropped in a row
+    uint64_t resyncs; // Times the deadline was too far behind to catch up
+    double render_ms; // Time spent drawing and presenting
+} frame_pacer_t;
+
+#define METRICS_BUCKETS 400 // 0.25 ms frame time histogram buckets, up to 100 ms
+
+// Runtime performance metrics, accumulated per interval for the HUD,
+// the window title and --metrics
+typedef struct {
+    FILE *file; // --metrics output, NULL = off
+    uint64_t interval_start; // Perf counter time the current interval started
+    uint64_t last_frame; // Perf counter time the previous frame ended
+    uint32_t frames; // Frames ended this interval
+    double emulate_ms, render_ms, present_ms; // Summed over this interval
+    uint32_t histogram[METRICS_BUCKETS]; // Frame to frame times this interval, last bucket also counts anything slower
+    uint64_t insts_start, presented_start, skipped_start; // Counters when the interval started
+    uint32_t underruns_start;
+
+    // Last completed interval, what the HUD shows
+    double seconds; // Since the first interval started
+    double ips, fps; // Instructions per second, presents per second
+    double emulate, render, present; // Mean ms per frame
+    double p50, p95, p99, max; // Frame time percentiles, ms
+    uint64_t dropped; // Presents dropped by the frame pacer
+    uint32_t underruns; // Audio underruns
+} metrics_t;
+
+// Static ROM analysis, flags per RAM address
+#define ADDR_CODE    (1 << 0) // A reachable instruction starts here
+#define ADDR_LEADER  (1 << 1) // First instruction of a basic block
+#define ADDR_CALLED  (1 << 2) // 2NNN target
+#define ADDR_SPRITE  (1 << 3) // Drawn by DXYN
+#define ADDR_LOADED  (1 << 4) // Read by FX65
+#define ADDR_WRITTEN (1 << 5) // Written by FX33/FX55
+
+typedef struct {
+    uint8_t flags[RAM_MASK + 1]; // ADDR_* flags
+    uint16_t rom_end; // One past the last non-zero ROM byte
+    uint32_t instructions, blocks;
+    uint32_t smc_bytes; // Code bytes written by FX33/FX55, need invalidation when cached
+    bool unknown_writes; // FX33/FX55 with I not known statically, could write anywhere
+    bool indirect_jumps; // BNNN seen, its targets are not followed
+} analysis_t;
+
+// Debugger stop reasons
+typedef enum {
+    STOP_NONE,
+    STOP_BREAKPOINT,
+    STOP_WATCH_READ,
+    STOP_WATCH_WRITE,
+    STOP_CONDITION,
+    STOP_STEP,
+    STOP_INTERRUPT, // Monitor "stop", GDB Ctrl-C, or waiting at startup
+} stop_reason_t;
+
+// Register numbers used by register conditions and the GDB stub, 0x0-0xF are V0-VF
+enum {
+    REG_I = 16,
+    REG_PC,
+    REG_SP,
+    REG_DT,
+    REG_ST,
+    REG_COUNT,
+};
+
+// Comparisons for register conditions
+typedef enum {
+    COND_EQ,
+    COND_NE,
+    COND_LT,
+    COND_GT,
+    COND_LE,
+    COND_GE,
+} cond_op_t;
+
+#define DEBUG_MAX_CONDS 8
+
+// Register condition break, stops when "reg op value" becomes true
+typedef struct {
+    uint8_t reg; // REG_* or 0x0-0xF for V0-VF
+    cond_op_t op;
+    uint16_t value;
+    bool was_true; // Result after the previous instruction, conditions are edge triggered
+} debug_cond_t;
+
+// Breakpoints, watchpoints and stepping. While none are set (armed false) the
+// main loop runs the normal interpreter, otherwise the checked one.
+typedef struct {
+    uint8_t breakpoints[(RAM_MASK + 1) / 8]; // PC breakpoint bitmap
+    uint8_t watch_read[(RAM_MASK + 1) / 8]; // Data read watchpoint bitmap, instruction fetches excluded
+    uint8_t watch_write[(RAM_MASK + 1) / 8]; // Data write watchpoint bitmap
+    uint32_t num_breakpoints;
+    uint32_t num_watches; // Bits set in watch_read and watch_write
+    debug_cond_t conds[DEBUG_MAX_CONDS];
+    uint32_t num_conds;
+    uint32_t steps; // Instructions left to single step, 0 = not stepping
+    bool armed; // Any breakpoint, watchpoint, condition or step set
+    bool stopped; // Machine halted, waiting for a continue/step command
+    bool reported; // Stop already reported to the monitor/GDB
+    bool modified; // Registers or RAM written by a command since poll_debugger() returned
+    bool resuming; // Skip the breakpoint at PC for the first instruction after a resume
+    stop_reason_t reason;
+    stop_reason_t pending; // Watch hit by the instruction being executed
+    uint16_t stop_address; // Watched address for STOP_WATCH_*
+    char line[256]; // Partial monitor command line
+    size_t line_len;
+} debugger_t;
+
+// Checked interpreter, emulates up to count instructions and returns how many
+// ran before the debugger stopped the machine
+typedef uint32_t (*checked_interpreter_t)(chip8_t *chip8, const config_t *config, debugger_t *debugger,
+                                          const uint32_t count);
+
+// GDB remote serial protocol stub, one client at a time
+typedef struct {
+    int listen_fd;
+    int fd; // Connected client, -1 = none
+    char in[4096]; // Received bytes not yet parsed into packets
+    size_t in_len;
+    bool running; // Client resumed the machine and is owed a stop reply
+} gdb_stub_t;
+
+// Capture output formats
+typedef enum {
+    CAPTURE_Y4M,  // YUV4MPEG2 4:4:4 video, 60 fps
+    CAPTURE_RGBA, // Raw RGBA bytes, 64x32 * capture_scale per frame, 60 fps
+    CAPTURE_GIF,  // Animated GIF, identical frames merged into one delay
+} capture_format_t;
+
+// One queued capture frame
+typedef struct {
+    uint32_t pixels[64*32]; // Snapshot of pixel_color (RGBA8888)
+    uint64_t display[32]; // Snapshot of display, for pixel outlines
+    uint32_t repeat; // Number of identical frames that followed this one
+} capture_frame_t;
+
+#define CAPTURE_QUEUE_LEN 64 // Frames buffered between emulator and writer thread
+
+// Background frame capture object
+typedef struct {
+    capture_format_t format;
+    FILE *file;
+    config_t config; // Copy of config at capture start, colors/scale/filter to write with
+    uint32_t width, height; // Output frame size after scaling
+    uint32_t *scaled; // Rasterized frame, writer thread only
+    uint8_t *bytes; // Frame converted to output format, writer thread only
+
+    // Bounded frame queue, emulator thread produces, writer thread consumes
+    capture_frame_t *queue; // CAPTURE_QUEUE_LEN frames
+    uint32_t head, tail; // Read/write positions, queue is empty when equal
+    bool done; // Producer is finished, writer exits once queue drained
+    SDL_mutex *lock;
+    SDL_cond *cond;
+    SDL_Thread *thread;
+
+    // Emulator thread side deduplication; last distinct frame not yet queued
+    capture_frame_t pending;
+    bool has_pending;
+
+    // Writer thread side state
+    uint32_t gif_carry; // GIF frame time not yet emitted, in 1/6000 s units
+
+    // Stats
+    uint64_t frames_seen; // Every frame handed to capture_frame()
+    uint64_t frames_queued; // Distinct frames queued for writing
+    uint64_t frames_dropped; // Distinct frames dropped because queue was full
+} capture_t;
+
 // Color "lerp" helper function
 uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const float t){
     const uint8_t s_r = (start_color >> 24) & 0xFF;
@@ -95,10 +452,32 @@ uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const
     return (ret_r << 24) | (ret_g << 16) | (ret_b << 8) | ret_a;
 }
 
+// Audio callback timing. SDL does not report underruns to callback devices,
+// so a callback arriving more than two buffers after the previous one (the
+// device ran dry in between) is counted as one.
+typedef struct {
+    uint64_t last_callback; // Perf counter time of the previous callback, 0 = device was just resumed
+    uint64_t buffer_ticks; // Perf counter ticks one device buffer lasts
+    uint32_t underruns; // Written by the audio thread
+    bool playing; // Device unpaused, main thread only
+} audio_stats_t;
+
+static audio_stats_t audio_stats;
+
+// Called at the start of every audio callback
+static inline void audio_stats_callback(void){
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const uint64_t last = __atomic_exchange_n(&audio_stats.last_callback, now, __ATOMIC_RELAXED);
+    if(last && now - last > 2 * audio_stats.buffer_ticks){
+        __atomic_fetch_add(&audio_stats.underruns, 1, __ATOMIC_RELAXED);
+    }
+}
+
 // SDL Audio Callback
 // Fill out stream/audio buffer with audio data
 void audio_callback(void *userdata, uint8_t *stream, int len){
     config_t *config = (config_t *) userdata;
+    audio_stats_callback();
 
     int16_t *audio_data = (int16_t *) stream;
     static uint32_t running_sample_index = 0;
@@ -113,8 +492,8 @@ void audio_callback(void *userdata, uint8_t *stream, int len){
 
 }
 
-// Initialize SDL
-bool init_sdl(sdl_t *sdl, config_t *config, const char rom_name[]){
+// Initialize SDL, audio is generated by callback(userdata, ...)
+bool init_sdl(sdl_t *sdl, config_t *config, const char rom_name[], SDL_AudioCallback callback, void *userdata){
     if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER ) != 0) {
         SDL_Log("Could not initialize SDL subsystem! %s\n", SDL_GetError());
         return false;
@@ -146,8 +525,8 @@ bool init_sdl(sdl_t *sdl, config_t *config, const char rom_name[]){
         .format = AUDIO_S16LSB, // 16-bit signed little-endian  
         .channels = 1, // Mono
         .samples = 512,
-        .callback = audio_callback,
-        .userdata = config, // Userdata passed to audio callback
+        .callback = callback,
+        .userdata = userdata, // Userdata passed to audio callback
     };
 
     sdl->dev = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
@@ -162,13 +541,13 @@ bool init_sdl(sdl_t *sdl, config_t *config, const char rom_name[]){
         return false;
     }
 
+    audio_stats.buffer_ticks = (uint64_t)sdl->have.samples * SDL_GetPerformanceFrequency() / sdl->have.freq;
+
     return true;
 }
 
-// Setup initial emulator configuration from arguments
-bool set_config_from_args(config_t *config, const int argc, char **argv){
-
-    // Set defaults
+// Default emulator configuration, before any ROM profile or argument
+void set_config_defaults(config_t *config){
     *config = (config_t){
         .window_width = 64,
         .window_height = 32,
@@ -182,912 +561,5173 @@ bool set_config_from_args(config_t *config, const int argc, char **argv){
         .audio_sample_rate = 44100, // CD quality audio
         .color_lerp_rate = 0.7, // Color lerp rate, between [0.1, 1.0]
         .current_extension = CHIP8, // Default to CHIP8
+        .quirks = UINT32_MAX, // Unset, filled in from current_extension
+        .capture_scale = 1, // Capture at native 64x32
+        .raster_filter = FILTER_NONE,
+        .input_slices = 4, // Poll input 4 times per 60hz frame
+        .fusion = true, // Fuse common instruction sequences
+        .max_skip = 4, // Present at least every 5th frame (12 fps) when rendering is slow
+        .metrics_interval = 1000, // Metrics/HUD/title once a second
+        .keymap = { // CHIP8 keypad on the left of a QWERTY keyboard, see handle_input()
+            SDLK_x, SDLK_1, SDLK_2, SDLK_3, SDLK_q, SDLK_w, SDLK_e, SDLK_a,
+            SDLK_s, SDLK_d, SDLK_z, SDLK_c, SDLK_4, SDLK_r, SDLK_f, SDLK_v,
+        },
+        .profile_db = "chip8.db", // Profiles for known ROMs, if the file exists
     };
+}
 
-    // Override defaults from passed arguments
-    for(int i = 1; i < argc; i++){
+// Override the configuration from argv[first] onwards, ROM profiles are parsed here too
+void parse_config_args(config_t *config, const int first, const int argc, char **argv){
+    for(int i = first; i < argc; i++){
         (void) argv[i];
         // e.g. set scale factor
-        if (strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0){
+        if (strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0 && i + 1 < argc){
             // Note: should probably add checks for numeric
             i++;
             config->scale_factor = (uint32_t)strtol(argv[i], NULL, 10);
         }
+        else if (strncmp(argv[i], "--ips", strlen("--ips")) == 0 && i + 1 < argc){
+            i++;
+            config->insts_per_second = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--extension", strlen("--extension")) == 0 && i + 1 < argc){
+            i++;
+            if(strcmp(argv[i], "superchip") == 0) config->current_extension = SUPERCHIP;
+            else if(strcmp(argv[i], "xochip") == 0) config->current_extension = XOCHIP;
+            else config->current_extension = CHIP8;
+        }
+        else if (strncmp(argv[i], "--quirks", strlen("--quirks")) == 0 && i + 1 < argc){
+            // Custom QUIRK_* bitset, e.g. 0x5 = VF reset + memory increments I
+            i++;
+            config->quirks = (uint32_t)strtol(argv[i], NULL, 0) & ((1 << QUIRK_COUNT) - 1);
+        }
+        else if (strncmp(argv[i], "--no-fusion", strlen("--no-fusion")) == 0){
+            config->fusion = false;
+        }
+        else if (strncmp(argv[i], "--fusion", strlen("--fusion")) == 0){
+            config->fusion = true;
+        }
+        else if (strncmp(argv[i], "--no-vip-timing", strlen("--no-vip-timing")) == 0){
+            config->vip_timing = false;
+        }
+        else if (strncmp(argv[i], "--vip-timing", strlen("--vip-timing")) == 0){
+            config->vip_timing = true;
+        }
+        else if (strncmp(argv[i], "--fg-color", strlen("--fg-color")) == 0 && i + 1 < argc){
+            // RGBA8888 in hex, e.g. FFB000FF
+            i++;
+            config->fg_color = (uint32_t)strtoul(argv[i], NULL, 16);
+        }
+        else if (strncmp(argv[i], "--bg-color", strlen("--bg-color")) == 0 && i + 1 < argc){
+            i++;
+            config->bg_color = (uint32_t)strtoul(argv[i], NULL, 16);
+        }
+        else if (strncmp(argv[i], "--no-outlines", strlen("--no-outlines")) == 0){
+            config->pixel_outlines = false;
+        }
+        else if (strncmp(argv[i], "--outlines", strlen("--outlines")) == 0){
+            config->pixel_outlines = true;
+        }
+        else if (strncmp(argv[i], "--tone", strlen("--tone")) == 0 && i + 1 < argc){
+            i++;
+            config->square_wave_freq = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--volume", strlen("--volume")) == 0 && i + 1 < argc){
+            i++;
+            const long volume = strtol(argv[i], NULL, 10);
+            config->volume = (uint16_t)(volume < 0 ? 0 : volume > INT16_MAX ? INT16_MAX : volume);
+        }
+        else if (strncmp(argv[i], "--lerp-rate", strlen("--lerp-rate")) == 0 && i + 1 < argc){
+            i++;
+            config->color_lerp_rate = strtof(argv[i], NULL);
+        }
+        else if (strncmp(argv[i], "--keymap", strlen("--keymap")) == 0 && i + 1 < argc){
+            // 16 host keys for CHIP8 keys 0-F, e.g. the default x123qweasdzc4rfv
+            i++;
+            if(strlen(argv[i]) != 16){
+                SDL_Log("--keymap needs 16 keys, one per CHIP8 key 0-F, ignoring %s\n", argv[i]);
+                continue;
+            }
+            for(uint32_t key = 0; key < 16; key++){
+                // SDL keycodes of printable keys are their lowercase characters
+                config->keymap[key] = tolower((unsigned char)argv[i][key]);
+            }
+        }
+        else if (strncmp(argv[i], "--profiles", strlen("--profiles")) == 0 && i + 1 < argc){
+            i++;
+            config->profile_db = argv[i];
+            config->profile_db_given = true;
+        }
+        else if (strncmp(argv[i], "--no-profile", strlen("--no-profile")) == 0){
+            config->profile_db = NULL;
+        }
+        else if (strncmp(argv[i], "--save-profile", strlen("--save-profile")) == 0 && i + 1 < argc){
+            i++;
+            config->save_profile = argv[i];
+        }
+        else if (strncmp(argv[i], "--session", strlen("--session")) == 0 && i + 1 < argc){
+            // Another ROM hosted in the same window, see run_host()
+            i++;
+            if(config->num_sessions < MAX_SESSIONS - 1) config->session_roms[config->num_sessions++] = argv[i];
+            else SDL_Log("At most %u sessions, ignoring %s\n", (unsigned)MAX_SESSIONS, argv[i]);
+        }
+        else if (strncmp(argv[i], "--threads", strlen("--threads")) == 0 && i + 1 < argc){
+            i++;
+            config->threads = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--route", strlen("--route")) == 0 && i + 1 < argc){
+            i++;
+            config->route_keymap = strcmp(argv[i], "keymap") == 0;
+        }
+        else if (strncmp(argv[i], "--run-ahead", strlen("--run-ahead")) == 0 && i + 1 < argc){
+            i++;
+            config->run_ahead_frames = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--input-slices", strlen("--input-slices")) == 0 && i + 1 < argc){
+            i++;
+            config->input_slices = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--max-skip", strlen("--max-skip")) == 0 && i + 1 < argc){
+            i++;
+            config->max_skip = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--hud", strlen("--hud")) == 0){
+            config->hud = true;
+        }
+        else if (strncmp(argv[i], "--metrics-interval", strlen("--metrics-interval")) == 0 && i + 1 < argc){
+            i++;
+            config->metrics_interval = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--metrics", strlen("--metrics")) == 0 && i + 1 < argc){
+            i++;
+            config->metrics_file = argv[i];
+        }
+        else if (strncmp(argv[i], "--latency-stats", strlen("--latency-stats")) == 0){
+            config->latency_stats = true;
+        }
+        else if (strncmp(argv[i], "--trap-violations", strlen("--trap-violations")) == 0){
+            config->trap_violations = true;
+        }
+        else if (strncmp(argv[i], "--shm", strlen("--shm")) == 0 && i + 1 < argc){
+            i++;
+            config->shm_name = argv[i];
+        }
+        else if (strncmp(argv[i], "--monitor", strlen("--monitor")) == 0){
+            config->monitor = true;
+        }
+        else if (strncmp(argv[i], "--gdb", strlen("--gdb")) == 0 && i + 1 < argc){
+            i++;
+            config->gdb_port = (uint16_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--headless", strlen("--headless")) == 0){
+            // No window or audio, emulate frames back to back without 60hz delay
+            config->headless = true;
+        }
+        else if (strncmp(argv[i], "--frames", strlen("--frames")) == 0 && i + 1 < argc){
+            i++;
+            config->max_frames = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--capture-scale", strlen("--capture-scale")) == 0 && i + 1 < argc){
+            i++;
+            config->capture_scale = (uint32_t)strtol(argv[i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--capture", strlen("--capture")) == 0 && i + 1 < argc){
+            i++;
+            config->capture_file = argv[i];
+        }
+        else if (strncmp(argv[i], "--filter", strlen("--filter")) == 0 && i + 1 < argc){
+            i++;
+            if(strcmp(argv[i], "scanlines") == 0) config->raster_filter = FILTER_SCANLINES;
+            else if(strcmp(argv[i], "scale2x") == 0) config->raster_filter = FILTER_SCALE2X;
+            else config->raster_filter = FILTER_NONE;
+        }
+        else if (strncmp(argv[i], "--analyze", strlen("--analyze")) == 0 && i + 1 < argc){
+            i++;
+            config->analysis_file = argv[i];
+        }
+        else if (strncmp(argv[i], "--screenshot", strlen("--screenshot")) == 0 && i + 1 < argc){
+            i++;
+            config->screenshot_file = argv[i];
+        }
     }
-
-    return true; // Success
 }
 
-//Initialize CHIP8 Machine
-bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]){
-    const uint32_t entry_point = 0x200; //CHIP8 Roms will be loaded to 0x200
-    const uint8_t font[] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0   
-        0x20, 0x60, 0x20, 0x20, 0x70,   // 1  
-        0xF0, 0x10, 0xF0, 0x80, 0xF0,   // 2 
-        0xF0, 0x10, 0xF0, 0x10, 0xF0,   // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10,   // 4    
-        0xF0, 0x80, 0xF0, 0x10, 0xF0,   // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0,   // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40,   // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0,   // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0,   // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90,   // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0,   // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0,   // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0,   // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
-    };
+// Fill in settings derived from others and check the combination, once all
+// arguments (and any ROM profile) are parsed
+bool check_config(config_t *config){
+    if(config->capture_scale == 0) config->capture_scale = 1;
+    if(config->input_slices == 0) config->input_slices = 1;
+    if(config->metrics_interval == 0) config->metrics_interval = 1000;
+    if(!(config->color_lerp_rate >= 0.1f)) config->color_lerp_rate = 0.1f;
+    if(config->color_lerp_rate > 1.0f) config->color_lerp_rate = 1.0f;
+    if(config->square_wave_freq == 0) config->square_wave_freq = 440;
 
-    // Initialize entire CHIP8 machine
-    memset(chip8, 0, sizeof(chip8_t));
-    
-    // Load font
-    memcpy(&chip8->ram[0], font, sizeof(font));
+    // Quirks implied by the extension, unless a custom set was given
+    if(config->quirks == UINT32_MAX){
+        config->quirks = (config->current_extension == CHIP8) ?
+                         (QUIRK_VF_RESET | QUIRK_SHIFT_VY | QUIRK_MEMORY_INC_I) : 0;
 
-    // Open ROM file
-    FILE *rom = fopen(rom_name, "rb");
-    if(!rom){
-        SDL_Log("Rom file is %s is invalid or does not exist\n", rom_name);
-        return false;
+        // The VIP waits for vblank in DXYN, only meaningful once frames are paced by its clock
+        if(config->current_extension == CHIP8 && config->vip_timing) config->quirks |= QUIRK_DISPLAY_WAIT;
     }
 
-    // Get and check rom size
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof chip8->ram - entry_point;
-    rewind(rom);
-
-    if(rom_size > max_size){
-        SDL_Log("Rom file %s is too big! Rom size: %llu, Max size allowed: %llu\n", rom_name, (long long unsigned)rom_size, (long long unsigned)max_size);
+    if(config->headless && config->max_frames == 0){
+        SDL_Log("Headless mode needs --frames <count> to know when to stop\n");
         return false;
     }
 
-    // Load ROM
-    if (fread(&chip8->ram[entry_point], rom_size, 1, rom) != 1){
-        SDL_Log("Could not read ROM file %s into CHIP8 memory\n", rom_name);
-        return false;
+    // Hosted sessions only share the window, audio, HUD and metrics; the rest
+    // drives a single machine and would silently do nothing
+    if(config->num_sessions){
+        const char *option = config->capture_file ? "--capture" :
+                             config->screenshot_file ? "--screenshot" :
+                             config->shm_name ? "--shm" :
+                             config->monitor ? "--monitor" :
+                             config->gdb_port ? "--gdb" :
+                             config->run_ahead_frames ? "--run-ahead" :
+                             config->save_profile ? "--save-profile" :
+                             config->analysis_file ? "--analyze" :
+                             config->latency_stats ? "--latency-stats" :
+                             config->trap_violations ? "--trap-violations" : NULL;
+        if(option){
+            SDL_Log("%s only works with a single ROM, not with --session\n", option);
+            return false;
+        }
     }
 
-    fclose(rom);
-
-    // Set chip8 machine defaults
-    chip8->state = RUNNING; // Default machine state to on/running
-    chip8->PC = entry_point; // Start program counter at ROM entry point
-    chip8->rom_name = rom_name; // Set ROM name
-    chip8->stack_ptr = &chip8->stack[0];
-    memset(&chip8->pixel_color[0], config.bg_color, sizeof chip8->pixel_color);
-
-    return true;
-}
+#ifndef CHIP8_POSIX
+    if(config->monitor || config->gdb_port){
+        SDL_Log("The debugger monitor and GDB stub need a POSIX system\n");
+        return false;
+    }
+#endif
 
-void final_cleanup(const sdl_t sdl){
-    SDL_DestroyRenderer(sdl.renderer); // Destroy renderer
-    SDL_DestroyWindow(sdl.window); // Destroy window
-    SDL_CloseAudioDevice(sdl.dev); // Close audio device
-    SDL_Quit(); // Shut down SDL subsystem
+    return true; // Success
 }
 
-// Clear screen / SDl Window to background color
-void clear_screen(const sdl_t sdl, const config_t config){
-    const uint8_t r = (config.bg_color >> 24) & 0xFF;
-    const uint8_t g = (config.bg_color >> 16) & 0xFF;
-    const uint8_t b = (config.bg_color >> 8) & 0xFF;
-    const uint8_t a = (config.bg_color >> 0) & 0xFF;
-
-    SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-    SDL_RenderClear(sdl.renderer);
+// Setup initial emulator configuration from arguments
+bool set_config_from_args(config_t *config, const int argc, char **argv){
+    set_config_defaults(config);
+    parse_config_args(config, 1, argc, argv);
+    return check_config(config);
 }
 
-// Update window with any changes
-void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8){
-    SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
-    // Grab color values ot draw
-
-    /*const uint8_t fg_r = (config.fg_color >> 24) & 0xFF;
-    const uint8_t fg_g = (config.fg_color >> 16) & 0xFF;
-    const uint8_t fg_b = (config.fg_color >> 8) & 0xFF;
-    const uint8_t fg_a = (config.fg_color >> 0) & 0xFF;*/
-
-    const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
-    const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
-    const uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
-    const uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
-
-    for(uint32_t i = 0; i < sizeof chip8->display; i++){
-        // Translate 1D index i value to 2D X/Y Coordinates
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
+// ROM profiles
 
-        if(chip8->display[i]){
+// The database is a text file with one line per ROM, "<hash> <options>",
+// the hash being 16 hex digits of hash_rom() and the options in command line
+// syntax up to an optional "# comment". Lines are sorted by hash so a lookup
+// is a binary search of the mapped file; comments and blank lines may only
+// come before the first entry. "LC_ALL=C sort" keeps a hand edited file sorted.
+#define PROFILE_LINE_MAX 1024 // Longest database line
+#define PROFILE_MAX_ARGS 64 // Most options in one profile
 
-            if(chip8->pixel_color[i] != config.fg_color){
-                // Lerp color to foreground color
-                chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], config.fg_color, config.color_lerp_rate);
-            }
+// FNV-1a 64 bit hash of a ROM image, keys its profile
+uint64_t hash_rom(const uint8_t *rom, const size_t size){
+    uint64_t hash = 0xCBF29CE484222325;
+    for(size_t i = 0; i < size; i++){
+        hash = (hash ^ rom[i]) * 0x100000001B3;
+    }
+    return hash;
+}
 
-            const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const uint8_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
-            const uint8_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+// Hash a database line starts with, 0 for comment, blank or malformed lines
+// so they sort before every entry. The 16 hex digits must end the line or be
+// followed by whitespace.
+uint64_t profile_line_hash(const char *line, const char *end){
+    if(end - line < 16) return 0;
+    if(end - line > 16 && line[16] != ' ' && line[16] != '\t' && line[16] != '\r' && line[16] != '\n') return 0;
 
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
+    uint64_t hash = 0;
+    for(uint32_t i = 0; i < 16; i++){
+        const char c = line[i];
+        const uint32_t digit = (c >= '0' && c <= '9') ? (uint32_t)(c - '0') :
+                               (c >= 'a' && c <= 'f') ? (uint32_t)(c - 'a' + 10) :
+                               (c >= 'A' && c <= 'F') ? (uint32_t)(c - 'A' + 10) : 16;
+        if(digit == 16) return 0;
+        hash = (hash << 4) | digit;
+    }
+    return hash;
+}
 
-            // If user requested drawing pixel outlines, draw those here
-            if(config.pixel_outlines){
-                SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-                SDL_RenderDrawRect(sdl.renderer, &rect);
-            }
+// Binary search a sorted database for hash. Returns the options after the
+// hash, length in *length, or NULL if the ROM has no profile.
+const char *find_profile(const char *db, const size_t size, const uint64_t hash, size_t *length){
+    const char *lo = db, *hi = db + size; // Line starts in [lo, hi) not yet ruled out
+    while(lo < hi){
+        // Line containing the midpoint
+        const char *line = lo + (hi - lo) / 2;
+        while(line > lo && line[-1] != '\n') line--;
+        const char *end = memchr(line, '\n', (size_t)(db + size - line));
+        if(!end) end = db + size;
 
+        const uint64_t line_hash = profile_line_hash(line, end);
+        if(line_hash < hash){
+            lo = end + 1;
+        }
+        else if(line_hash > hash){
+            hi = line;
         }
         else{
-
-            if(chip8->pixel_color[i] != config.bg_color){
-                // Lerp color to background color
-                chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], config.bg_color, config.color_lerp_rate);
-            }
-
-            const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const uint8_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
-            const uint8_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
-
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
+            *length = (size_t)(end - line - 16);
+            return line + 16;
         }
     }
-    SDL_RenderPresent(sdl.renderer);
+    return NULL;
 }
 
-// Handle Input
-// CHIP8 Keypad     QWERTY
-// 123C             1234
-// 456D             qwer
-// 789E             asdf
-// A0BF             zxcv
-void handle_input(chip8_t *chip8, config_t *config){
-    SDL_Event event;
-    while(SDL_PollEvent(&event)){
-        switch(event.type){
-            case SDL_QUIT:
-                // Exit window; End program
-                chip8->state = QUIT; // Will exit main loop
-                break;
+// Apply the ROM's profile from config->profile_db, if it has one: defaults,
+// then the profile's options, then the command line again so it always wins.
+// *applied says whether a profile was found. Only a missing --profiles file
+// is an error, the default database is optional.
+bool apply_rom_profile(config_t *config, const int argc, char **argv, const uint64_t hash, bool *applied){
+    char *args[PROFILE_MAX_ARGS + 1]; // NULL terminated like argv
+    *applied = false;
 
-            case SDL_KEYDOWN:
-                switch(event.key.keysym.sym){
-                    case SDLK_ESCAPE:
-                        // Escape key;
-                        chip8->state = QUIT;
-                        break;
-                    case SDLK_SPACE:
-                        // Pause/Unpause emulator
-                        if(chip8->state == RUNNING){
-                            chip8->state = PAUSED;
-                            puts("==== PAUSED ====");
-                        }
-                        else{
-                            chip8->state = RUNNING;   
-                        }
-                        break;
-                     case SDLK_EQUALS:
-                        // "=" Reset CHIP8 machine for the current ROM
-                        init_chip8(chip8, *config, chip8->rom_name);
-                        break;
-                    case SDLK_j:
-                        // 'j' Decrease color lerp rate
-                        if(config->color_lerp_rate > 0.1){
-                            config->color_lerp_rate -= 0.1;
-                        }
-                        break;
-                    case SDLK_k:
-                        // 'j' Increase color lerp rate
-                        if(config->color_lerp_rate < 1.0){
-                            config->color_lerp_rate += 0.1;
-                        }
-                        break;
-                    case SDLK_o:
-                        // 'o' Decrease volume
-                        if(config->volume > 0){
-                            config->volume -= 500;
-                        }
-                        break;
-                    case SDLK_p:
-                        // 'p' Increase volume
-                        if(config->volume < INT16_MAX){
-                            config->volume += 500;
-                        }
-                        break;
+    FILE *file = fopen(config->profile_db, "rb");
+    if(!file){
+        if(!config->profile_db_given) return true;
+        SDL_Log("Could not open profile database %s\n", config->profile_db);
+        return false;
+    }
 
-                    // Map qwrert keys to CHIP8 keypad
-                    case SDLK_1: chip8->keypad[0x1] = true; break;
-                    case SDLK_2: chip8->keypad[0x2] = true; break;
-                    case SDLK_3: chip8->keypad[0x3] = true; break;
-                    case SDLK_4: chip8->keypad[0xC] = true; break;
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    const char *options = NULL;
+    size_t length = 0;
+    char *line = NULL; // Copy of the options, config references them for the whole run so it's never freed
 
-                    case SDLK_q: chip8->keypad[0x4] = true; break;
-                    case SDLK_w: chip8->keypad[0x5] = true; break;
-                    case SDLK_e: chip8->keypad[0x6] = true; break;
-                    case SDLK_r: chip8->keypad[0xD] = true; break;
+#ifdef CHIP8_POSIX
+    // Mapped, a lookup only touches the pages the binary search visits
+    void *db = (size > 0) ? mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(file), 0) : MAP_FAILED;
+    if(db != MAP_FAILED){
+        options = find_profile(db, (size_t)size, hash, &length);
+        if(options && length < PROFILE_LINE_MAX && (line = malloc(length + 1))) memcpy(line, options, length);
+        munmap(db, (size_t)size);
+    }
+#else
+    char *db = (size > 0) ? malloc((size_t)size) : NULL;
+    rewind(file);
+    if(db && fread(db, (size_t)size, 1, file) == 1){
+        options = find_profile(db, (size_t)size, hash, &length);
+        if(options && length < PROFILE_LINE_MAX && (line = malloc(length + 1))) memcpy(line, options, length);
+    }
+    free(db);
+#endif
+    fclose(file);
 
-                    case SDLK_a: chip8->keypad[0x7] = true; break;
-                    case SDLK_s: chip8->keypad[0x8] = true; break;
-                    case SDLK_d: chip8->keypad[0x9] = true; break;
-                    case SDLK_f: chip8->keypad[0xE] = true; break;
+    if(!options) return true;
+    if(length >= PROFILE_LINE_MAX){
+        SDL_Log("Profile %016llx in %s is longer than %u bytes, ignoring it\n", (long long unsigned)hash,
+                config->profile_db, (unsigned)PROFILE_LINE_MAX);
+        return true;
+    }
+    if(!line){
+        SDL_Log("Out of memory reading profile %016llx\n", (long long unsigned)hash);
+        return false;
+    }
+    line[length] = '\0';
 
-                    case SDLK_z: chip8->keypad[0xA] = true; break;
-                    case SDLK_x: chip8->keypad[0x0] = true; break;
-                    case SDLK_c: chip8->keypad[0xB] = true; break;
-                    case SDLK_v: chip8->keypad[0xF] = true; break;
+    // Split into arguments, up to any comment
+    int count = 0;
+    for(char *token = strtok(line, " \t\r"); token && token[0] != '#' && count < PROFILE_MAX_ARGS;
+        token = strtok(NULL, " \t\r")){
+        args[count++] = token;
+    }
+    args[count] = NULL;
 
-                    default: break;
-                }
-                break;
+    printf("ROM profile %016llx:", (long long unsigned)hash);
+    for(int i = 0; i < count; i++) printf(" %s", args[i]);
+    putchar('\n');
 
-            case SDL_KEYUP:
-                switch(event.key.keysym.sym){
+    set_config_defaults(config);
+    parse_config_args(config, 0, count, args);
+    parse_config_args(config, 1, argc, argv);
+    *applied = true;
+    return check_config(config);
+}
+
+// Append separator and text to a profile entry of PROFILE_LINE_MAX bytes
+static bool profile_append(char *entry, size_t *used, const char *separator, const char *text){
+    const size_t sep_length = strlen(separator), length = strlen(text);
+    if(*used + sep_length + length >= PROFILE_LINE_MAX){
+        SDL_Log("Profile is longer than %u bytes\n", (unsigned)PROFILE_LINE_MAX);
+        return false;
+    }
+    memcpy(entry + *used, separator, sep_length);
+    memcpy(entry + *used + sep_length, text, length + 1);
+    *used += sep_length + length;
+    return true;
+}
 
-                    // Map qwerty keys to CHIP8 keypad
-                    case SDLK_1: chip8->keypad[0x1] = false; break;
-                    case SDLK_2: chip8->keypad[0x2] = false; break;
-                    case SDLK_3: chip8->keypad[0x3] = false; break;
-                    case SDLK_4: chip8->keypad[0xC] = false; break;
+// Options about one run rather than how the ROM plays, never saved in a
+// profile, with the number of values each takes. Matched by prefix like
+// parse_config_args() does, in the same order.
+static const struct {
+    const char *name;
+    int values;
+} profile_skip_options[] = {
+    {"--profiles", 1}, {"--no-profile", 0}, {"--save-profile", 1},
+    {"--session", 1}, {"--threads", 1}, {"--route", 1},
+    {"--headless", 0}, {"--frames", 1},
+    {"--capture-scale", 1}, {"--capture", 1}, {"--filter", 1}, {"--screenshot", 1}, {"--analyze", 1},
+    {"--metrics-interval", 1}, {"--metrics", 1}, {"--latency-stats", 0}, {"--trap-violations", 0},
+    {"--shm", 1}, {"--monitor", 0}, {"--gdb", 1},
+};
 
-                    case SDLK_q: chip8->keypad[0x4] = false; break;
-                    case SDLK_w: chip8->keypad[0x5] = false; break;
-                    case SDLK_e: chip8->keypad[0x6] = false; break;
-                    case SDLK_r: chip8->keypad[0xD] = false; break;
+// Store this command line's options (less the ROM and the one-shot options
+// above) as the ROM's profile in path, replacing any existing entry and
+// keeping the file sorted
+bool save_rom_profile(const char *path, const uint64_t hash, const char *rom_name, const int argc, char **argv){
+    char entry[PROFILE_LINE_MAX];
+    size_t used = (size_t)snprintf(entry, sizeof entry, "%016llx", (long long unsigned)hash);
+    for(int i = 1; i < argc; i++){
+        if(argv[i] == rom_name) continue;
 
-                    case SDLK_a: chip8->keypad[0x7] = false; break;
-                    case SDLK_s: chip8->keypad[0x8] = false; break;
-                    case SDLK_d: chip8->keypad[0x9] = false; break;
-                    case SDLK_f: chip8->keypad[0xE] = false; break;
+        uint32_t skip = 0;
+        while(skip < sizeof profile_skip_options / sizeof profile_skip_options[0] &&
+              strncmp(argv[i], profile_skip_options[skip].name, strlen(profile_skip_options[skip].name)) != 0){
+            skip++;
+        }
+        if(skip < sizeof profile_skip_options / sizeof profile_skip_options[0]){
+            i += profile_skip_options[skip].values;
+            continue;
+        }
 
-                    case SDLK_z: chip8->keypad[0xA] = false; break;
-                    case SDLK_x: chip8->keypad[0x0] = false; break;
-                    case SDLK_c: chip8->keypad[0xB] = false; break;
-                    case SDLK_v: chip8->keypad[0xF] = false; break;
+        if(argv[i][0] == '#' || argv[i][strcspn(argv[i], " \t\r\n")]){
+            SDL_Log("Profile option \"%s\" can't contain spaces or start with #\n", argv[i]);
+            return false;
+        }
+        if(!profile_append(entry, &used, " ", argv[i])) return false;
+    }
 
-                    default: break;
-                }
+    // ROM file name as the comment
+    const char *base = strrchr(rom_name, '/');
+    if(!profile_append(entry, &used, " # ", base ? base + 1 : rom_name) || !profile_append(entry, &used, "", "\n")){
+        return false;
+    }
+
+    // Copy the database around the new entry through a temporary file
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "wb");
+    if(!out){
+        SDL_Log("Could not write profile database %s\n", tmp_path);
+        return false;
+    }
+
+    FILE *in = fopen(path, "rb");
+    bool written = false;
+    char line[PROFILE_LINE_MAX];
+    while(in && fgets(line, sizeof line, in)){
+        const uint64_t line_hash = profile_line_hash(line, line + strlen(line));
+        if(!written && line_hash >= hash && line_hash != 0){
+            fputs(entry, out);
+            written = true;
+        }
+        if(line_hash != hash) fputs(line, out);
+    }
+    if(!written) fputs(entry, out);
+    if(in) fclose(in);
+
+    if(fclose(out) != 0 || rename(tmp_path, path) != 0){
+        SDL_Log("Could not write profile database %s\n", path);
+        remove(tmp_path);
+        return false;
+    }
+
+    printf("Saved ROM profile %016llx to %s\n", (long long unsigned)hash, path);
+    return true;
+}
+
+// ROM analysis
+
+// Disassemble one opcode with Cowgod's mnemonics, numbers in hex
+void disassemble(const uint16_t opcode, char *out, const size_t size){
+    static const char *alu[16] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN", [0xE] = "SHL"};
+    const uint16_t NNN = opcode & 0x0FFF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint8_t N = opcode & 0x0F;
+    const uint8_t X = (opcode >> 8) & 0x0F;
+    const uint8_t Y = (opcode >> 4) & 0x0F;
+
+    switch(opcode >> 12){
+        case 0x0:
+            if(opcode == 0x00E0) snprintf(out, size, "CLS");
+            else if(opcode == 0x00EE) snprintf(out, size, "RET");
+            else snprintf(out, size, "SYS %03X", NNN);
+            return;
+        case 0x1: snprintf(out, size, "JP %03X", NNN); return;
+        case 0x2: snprintf(out, size, "CALL %03X", NNN); return;
+        case 0x3: snprintf(out, size, "SE V%X, %02X", X, NN); return;
+        case 0x4: snprintf(out, size, "SNE V%X, %02X", X, NN); return;
+        case 0x5: if(N == 0){ snprintf(out, size, "SE V%X, V%X", X, Y); return; } break;
+        case 0x6: snprintf(out, size, "LD V%X, %02X", X, NN); return;
+        case 0x7: snprintf(out, size, "ADD V%X, %02X", X, NN); return;
+        case 0x8: if(alu[N]){ snprintf(out, size, "%s V%X, V%X", alu[N], X, Y); return; } break;
+        case 0x9: if(N == 0){ snprintf(out, size, "SNE V%X, V%X", X, Y); return; } break;
+        case 0xA: snprintf(out, size, "LD I, %03X", NNN); return;
+        case 0xB: snprintf(out, size, "JP V0, %03X", NNN); return;
+        case 0xC: snprintf(out, size, "RND V%X, %02X", X, NN); return;
+        case 0xD: snprintf(out, size, "DRW V%X, V%X, %X", X, Y, N); return;
+        case 0xE:
+            if(NN == 0x9E){ snprintf(out, size, "SKP V%X", X); return; }
+            if(NN == 0xA1){ snprintf(out, size, "SKNP V%X", X); return; }
             break;
+        default:
+            switch(NN){
+                case 0x07: snprintf(out, size, "LD V%X, DT", X); return;
+                case 0x0A: snprintf(out, size, "LD V%X, K", X); return;
+                case 0x15: snprintf(out, size, "LD DT, V%X", X); return;
+                case 0x18: snprintf(out, size, "LD ST, V%X", X); return;
+                case 0x1E: snprintf(out, size, "ADD I, V%X", X); return;
+                case 0x29: snprintf(out, size, "LD F, V%X", X); return;
+                case 0x33: snprintf(out, size, "LD B, V%X", X); return;
+                case 0x55: snprintf(out, size, "LD [I], V%X", X); return;
+                case 0x65: snprintf(out, size, "LD V%X, [I]", X); return;
+            }
+            break;
+    }
+    snprintf(out, size, "DW %04X", opcode); // Not an instruction
+}
+
+static inline uint16_t analysis_opcode(const uint8_t *ram, const uint16_t address){
+    return (ram[address] << 8) | ram[(address + 1) & RAM_MASK];
+}
+
+// Does the instruction end its basic block (jump, call, return or skip)?
+static inline bool analysis_ends_block(const uint16_t opcode){
+    switch(opcode >> 12){
+        case 0x0: return opcode == 0x00EE;
+        case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x9: case 0xB: return true;
+        case 0xE: return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+        default: return false;
+    }
+}
+
+static inline void analysis_mark(analysis_t *analysis, const int32_t I, const uint32_t length, const uint8_t flag){
+    for(uint32_t i = 0; i < length; i++) analysis->flags[(I + i) & RAM_MASK] |= flag;
+}
+
+#define ANALYSIS_UNVISITED -2 // I at an address never reached
+#define ANALYSIS_UNKNOWN -1 // I not known statically
+
+// Walk everything reachable from the entry point, following jumps, calls,
+// returns to after the call and both sides of skips. I is tracked as a
+// constant where ANNN sets it, so DXYN/FX65 reads and FX33/FX55 writes can be
+// placed; where paths disagree it becomes unknown. BNNN targets depend on V0
+// and are not followed.
+void analyze_rom(analysis_t *analysis, const uint8_t *ram, const config_t *config){
+    int32_t I_in[RAM_MASK + 1]; // I on entry to each address
+    uint16_t work[RAM_MASK + 1];
+    bool queued[RAM_MASK + 1] = {false};
+    uint32_t num_work = 0;
+
+    memset(analysis, 0, sizeof *analysis);
+    for(uint32_t a = 0; a <= RAM_MASK; a++) I_in[a] = ANALYSIS_UNVISITED;
+
+    analysis->rom_end = RAM_MASK + 1;
+    while(analysis->rom_end > 0x200 && ram[analysis->rom_end - 1] == 0) analysis->rom_end--;
+
+    // Reach address with I, queueing it again if that changes what is known there
+    #define ANALYSIS_REACH(address, I) do { \
+        const uint16_t to_ = (address) & RAM_MASK; \
+        const int32_t I_ = (I); \
+        if(I_in[to_] == ANALYSIS_UNVISITED) I_in[to_] = I_; \
+        else if(I_in[to_] != I_ && I_in[to_] != ANALYSIS_UNKNOWN) I_in[to_] = ANALYSIS_UNKNOWN; \
+        else break; \
+        if(!queued[to_]){ queued[to_] = true; work[num_work++] = to_; } \
+    } while(0)
+
+    ANALYSIS_REACH(0x200, ANALYSIS_UNKNOWN);
+    analysis->flags[0x200] |= ADDR_LEADER;
+    while(num_work){
+        const uint16_t pc = work[--num_work];
+        queued[pc] = false;
+        analysis->flags[pc] |= ADDR_CODE;
+
+        const uint16_t opcode = analysis_opcode(ram, pc);
+        const uint16_t NNN = opcode & 0x0FFF;
+        const uint8_t X = (opcode >> 8) & 0x0F;
+        const uint16_t next = (pc + 2) & RAM_MASK;
+        int32_t I = I_in[pc];
+
+        switch(opcode >> 12){
+            case 0x0:
+                if(opcode != 0x00EE) ANALYSIS_REACH(next, I);
+                break;
+            case 0x1:
+                analysis->flags[NNN] |= ADDR_LEADER;
+                ANALYSIS_REACH(NNN, I);
+                break;
+            case 0x2:
+                // The subroutine may change I, after it returns I is unknown
+                analysis->flags[NNN] |= ADDR_LEADER | ADDR_CALLED;
+                analysis->flags[next] |= ADDR_LEADER;
+                ANALYSIS_REACH(NNN, I);
+                ANALYSIS_REACH(next, ANALYSIS_UNKNOWN);
+                break;
+            case 0xA:
+                ANALYSIS_REACH(next, NNN);
+                break;
+            case 0xB:
+                analysis->indirect_jumps = true;
+                break;
+            case 0xD:
+                if(I >= 0) analysis_mark(analysis, I, opcode & 0x0F, ADDR_SPRITE); // DXY0 draws no rows
+                ANALYSIS_REACH(next, I);
+                break;
+            case 0xF:
+                switch(opcode & 0xFF){
+                    case 0x1E: case 0x29: I = ANALYSIS_UNKNOWN; break;
+                    case 0x33:
+                        if(I >= 0) analysis_mark(analysis, I, 3, ADDR_WRITTEN);
+                        else analysis->unknown_writes = true;
+                        break;
+                    case 0x55: case 0x65:
+                        if(I < 0){
+                            if((opcode & 0xFF) == 0x55) analysis->unknown_writes = true;
+                            break;
+                        }
+                        analysis_mark(analysis, I, X + 1, (opcode & 0xFF) == 0x55 ? ADDR_WRITTEN : ADDR_LOADED);
+                        if(config->quirks & QUIRK_MEMORY_INC_I) I += X + 1;
+                        break;
+                }
+                ANALYSIS_REACH(next, I);
+                break;
             default:
+                if(analysis_ends_block(opcode)){
+                    // Skip, both the next and the one after are block leaders
+                    analysis->flags[next] |= ADDR_LEADER;
+                    analysis->flags[(next + 2) & RAM_MASK] |= ADDR_LEADER;
+                    ANALYSIS_REACH(next + 2, I);
+                }
+                ANALYSIS_REACH(next, I);
                 break;
         }
     }
+    #undef ANALYSIS_REACH
+
+    for(uint32_t a = 0; a <= RAM_MASK; a++){
+        if(!(analysis->flags[a] & ADDR_CODE)){
+            analysis->flags[a] &= ~ADDR_LEADER;
+            continue;
+        }
+        analysis->instructions++;
+
+        // Code only reached by a jump into it, not by falling through, also starts a block
+        const uint16_t prev = (a - 2) & RAM_MASK;
+        if(!(analysis->flags[prev] & ADDR_CODE) || analysis_ends_block(analysis_opcode(ram, prev))){
+            analysis->flags[a] |= ADDR_LEADER;
+        }
+        if(analysis->flags[a] & ADDR_LEADER) analysis->blocks++;
+    }
+
+    // Writes into either byte of an instruction are self-modifying code
+    for(uint32_t a = 0; a <= RAM_MASK; a++){
+        if((analysis->flags[a] & ADDR_WRITTEN) &&
+           ((analysis->flags[a] & ADDR_CODE) || (analysis->flags[(a - 1) & RAM_MASK] & ADDR_CODE))){
+            analysis->smc_bytes++;
+        }
+    }
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8){
-    printf("Address: 0x%04X, Opcode: 0x%04X Desc: ",chip8->PC-2, chip8->inst.opcode);
+// Successor edges of the block ending with the instruction at pc, 0-2 of them
+uint32_t analysis_successors(const uint8_t *ram, const uint16_t pc, uint16_t succ[2], bool *call){
+    const uint16_t opcode = analysis_opcode(ram, pc);
+    const uint16_t next = (pc + 2) & RAM_MASK;
+    *call = false;
 
-    // Emulate opcode
-    switch((chip8->inst.opcode >> 12) & 0x0F){
-        case 0x00:
-            if(chip8->inst.NN == 0xE0){
-                // 0x00E0: Clear screen
-                printf("Clear screen\n");
+    switch(opcode >> 12){
+        case 0x0: if(opcode == 0x00EE) return 0; break;
+        case 0x1: succ[0] = opcode & 0x0FFF; return 1;
+        case 0x2: succ[0] = opcode & 0x0FFF; succ[1] = next; *call = true; return 2;
+        case 0xB: return 0;
+        default:
+            if(analysis_ends_block(opcode)){
+                succ[0] = next;
+                succ[1] = (next + 2) & RAM_MASK;
+                return 2;
             }
-            else if(chip8->inst.NN == 0xEE){
-                // 0x00EE: Return from subroutine
-                // set progrma address to last address from subroutine stack ("pop" it off the stack)
-                // so that next opcode will be gotten from address.
-                printf("Return from subroutine to address 0x%04X \n", *(chip8->stack_ptr - 1));
+            break;
+    }
+    succ[0] = next;
+    return 1;
+}
+
+// Print address ranges with flag set, as "start-end" pairs
+void analysis_print_ranges(FILE *file, const analysis_t *analysis, const uint8_t flag){
+    uint32_t printed = 0;
+    for(uint32_t a = 0; a <= RAM_MASK; a++){
+        if(!(analysis->flags[a] & flag) || (a > 0 && (analysis->flags[a - 1] & flag))) continue;
+        uint32_t end = a;
+        while(end < RAM_MASK && (analysis->flags[end + 1] & flag)) end++;
+        fprintf(file, "%s%03X-%03X", printed++ ? ", " : " ", a, end);
+    }
+    fprintf(file, "%s\n", printed ? "" : " none");
+}
+
+// Write the analysis as a Graphviz DOT graph of basic blocks (path ending in
+// .dot) or a text report with the disassembly of every block
+bool write_analysis(const analysis_t *analysis, const chip8_t *chip8, const char *path){
+    const char *ext = strrchr(path, '.');
+    const bool dot = ext && strcmp(ext, ".dot") == 0;
+
+    FILE *file = fopen(path, "w");
+    if(!file){
+        SDL_Log("Could not write ROM analysis %s\n", path);
+        return false;
+    }
+
+    if(dot){
+        fprintf(file, "digraph \"%s\" {\n    node [shape=box fontname=monospace];\n", chip8->rom_name);
+    }
+    else{
+        fprintf(file, "ROM %s: 200-%03X, %u instructions in %u blocks\n", chip8->rom_name,
+                analysis->rom_end - 1, analysis->instructions, analysis->blocks);
+        fprintf(file, "Sprites:");
+        analysis_print_ranges(file, analysis, ADDR_SPRITE);
+        fprintf(file, "Loaded by FX65:");
+        analysis_print_ranges(file, analysis, ADDR_LOADED);
+        fprintf(file, "Written by FX33/FX55:");
+        analysis_print_ranges(file, analysis, ADDR_WRITTEN);
+        fprintf(file, "Self-modifying: %u code bytes written%s\n", analysis->smc_bytes,
+                analysis->unknown_writes ? ", plus writes through an unknown I" : "");
+        if(analysis->indirect_jumps) fprintf(file, "BNNN jumps present, their targets were not followed\n");
+    }
+
+    for(uint32_t a = 0; a <= RAM_MASK; a++){
+        if(!(analysis->flags[a] & ADDR_LEADER)) continue;
+
+        // Block runs until an instruction that ends it or the next leader
+        if(dot) fprintf(file, "    b%03X [label=\"", a);
+        else fprintf(file, "\n%03X:%s\n", a, (analysis->flags[a] & ADDR_CALLED) ? " (subroutine)" : "");
+
+        uint16_t pc = a;
+        while(true){
+            char text[32];
+            const uint16_t opcode = analysis_opcode(chip8->ram, pc);
+            disassemble(opcode, text, sizeof text);
+            const bool smc = (analysis->flags[pc] | analysis->flags[(pc + 1) & RAM_MASK]) & ADDR_WRITTEN;
+            if(dot) fprintf(file, "%03X  %s%s\\l", pc, text, smc ? "  (written)" : "");
+            else fprintf(file, "    %03X  %04X  %s%s\n", pc, opcode, text, smc ? "  ; written by FX33/FX55" : "");
+
+            const uint16_t next = (pc + 2) & RAM_MASK;
+            if(analysis_ends_block(opcode) || !(analysis->flags[next] & ADDR_CODE) ||
+               (analysis->flags[next] & ADDR_LEADER)){
+                break;
             }
-            else{
-                printf("Unimplemented Opcode\n");
+            pc = next;
+        }
+
+        uint16_t succ[2];
+        bool call;
+        const uint32_t num_succ = analysis_successors(chip8->ram, pc, succ, &call);
+        if(dot){
+            fprintf(file, "\"];\n");
+            for(uint32_t i = 0; i < num_succ; i++){
+                fprintf(file, "    b%03X -> b%03X%s;\n", a, succ[i], call && i == 0 ? " [style=dashed]" : "");
             }
-            break;
-        case 0x01:
+        }
+        else if(num_succ){
+            fprintf(file, "    ->");
+            for(uint32_t i = 0; i < num_succ; i++) fprintf(file, " %03X%s", succ[i], call && i == 0 ? " (call)" : "");
+            fprintf(file, "\n");
+        }
+    }
 
-            printf("Jump to address NNN (0x%04X)\n", chip8->inst.NNN);
-            break;
-        case 0x02:
-            // 0x2NNN: Call subroutine at NNN
-            // Store current address to return to on subroutine stack ("push" iton the stack)
-            // and set program counter to subroutine address so that the next opcode
-            // is gotten from there.
+    if(dot) fprintf(file, "}\n");
+    fclose(file);
+    return true;
+}
 
-            printf("Call subroutine at NNN (0x%04X)\n", chip8->inst.NNN);
-            break;
-        case 0x03:
-            printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",  chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-            break;
-        case 0x04:
-            printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",  chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-            break;
-        case 0x05:
-            printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",  chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-            break;
-        case 0x06:
-            // 0x6XNN: Set register V[X] to NN
-            printf("Set register V[%X] to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
-            break;
-        case 0x0A:
-            // 0xANNN: Set I to NNN
-            printf("Set I to NNN (0x%04X)\n", chip8->inst.NNN);
-            break;
-        case 0x0D:
-            printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) from memory location I (0x%04X). Set VF = 1 if any pixels are turned off\n", 
-                chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I);
-            break;
-        case 0x07:
-            // 0x6XNN: Set register V[X] to NN
-            printf("Set register V%X to NN (0X%02X) += NN (0X%02X). Result: 0X%02X\n", 
-                chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->V[chip8->inst.X] + chip8->inst.NN);
-            break;
-        case 0x08:
-            switch(chip8->inst.N){
-                case 0:
-                    // 0x8XY0: Set register VX = VY
-                    printf("Set register V%X = V%X (0X%02X)\n", 
-                        chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
-                    break;
-                case 1:
-                    // 0x8XY1: Set register VX |= VY
-                    printf("Set register V%X (0x%02X) |= V%X (0X%02X); Result: 0X%02X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->inst.Y, chip8->V[chip8->inst.Y],
-                        chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
-                    break;
-                case 2:
-                    // 0x8XY2: Set register VX &= VY
-                    printf("Set register V%X (0x%02X) &= V%X (0X%02X); Result: 0X%02X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->inst.Y, chip8->V[chip8->inst.Y],
-                        chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
-                    break;
-                case 3:
-                    // 0x8XY3: Set register VX ^= VY
-                    printf("Set register V%X (0x%02X) ^= V%X (0X%02X); Result: 0X%02X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->inst.Y, chip8->V[chip8->inst.Y],
-                        chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
-                    break;
-                case 4:
-                    // 0x8XY4: Set register VX += VY
-                    printf("Set register V%X (0x%02X) += V%X (0X%02X), VF = 1 if carry; Result: 0X%02X, VF = %X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->inst.Y, chip8->V[chip8->inst.Y],
-                        chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y],
-                        ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
-                    break;
-                case 5:
-                    // 0x8XY5: Set register VX -= VY
-                    printf("Set register V%X (0x%02X) -= V%X (0X%02X), VF = 1 if no borrow; Result: 0X%02X, VF = %X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
+// Fused operation starting at pc, 0 = none. All of its instructions must be
+// statically reachable code, so data that happens to look like code is left alone.
+uint8_t fuse_at(const uint8_t *ram, const analysis_t *analysis, const uint16_t pc){
+    if(pc + FUSE_WINDOW > RAM_MASK + 1) return 0; // No fused operation wraps around RAM
+    uint16_t op[3];
+    for(uint32_t i = 0; i < 3; i++){
+        op[i] = (analysis->flags[pc + 2 * i] & ADDR_CODE) ? analysis_opcode(ram, pc + 2 * i) : 0;
+    }
+    if(!(analysis->flags[pc] & ADDR_CODE) || !op[1]) return 0;
+
+    const uint8_t X = (op[0] >> 8) & 0x0F;
+    if((op[0] & 0xF0FF) == 0xF007 && op[1] == (0x3000 | (X << 8)) && op[2] == (0x1000 | pc)){
+        return FUSE_DELAY_POLL;
+    }
+    if((op[0] >> 12) == 0xA && (op[1] >> 12) == 0xD) return FUSE_LOAD_DRAW;
+    if((op[0] & 0xF0FF) == 0xF01E && (op[1] & 0xF0FF) == 0xF065) return FUSE_INDEX_LOAD;
+    if(((op[0] >> 12) == 0x3 || (op[0] >> 12) == 0x4) && (op[1] >> 12) == 0x1) return FUSE_SKIP_JUMP;
+
+    uint32_t chain = 0;
+    while(chain < FUSE_MAX_CHAIN && (analysis->flags[pc + 2 * chain] & ADDR_CODE) &&
+          (analysis_opcode(ram, pc + 2 * chain) >> 13) == 0x3){ // 6XNN or 7XNN
+        chain++;
+    }
+    return chain >= 2 ? FUSE_SET_CHAIN | (chain << 4) : 0;
+}
+
+// Instructions a fused operation covers at most
+static inline uint32_t fuse_length(const uint8_t fused){
+    switch(fused & FUSE_KIND_MASK){
+        case FUSE_SET_CHAIN: return fused >> 4;
+        case FUSE_DELAY_POLL: return 3;
+        default: return 2;
+    }
+}
+
+// Prewarm the image's fused operation table from a static analysis of its ROM.
+// Code the analysis cannot reach (BNNN targets, code written at run time) runs
+// unfused.
+void build_fusion(rom_image_t *image, const config_t *config){
+    analysis_t analysis;
+    analyze_rom(&analysis, image->ram, config);
+
+    memset(image->fused, 0, sizeof image->fused);
+    memset(image->fused_lines, 0, sizeof image->fused_lines);
+    for(uint32_t pc = 0; pc <= RAM_MASK; pc++){
+        const uint8_t fused = fuse_at(image->ram, &analysis, pc);
+        if(!fused) continue;
+
+        image->fused[pc] = fused;
+        for(uint32_t line = pc / FUSE_LINE; line <= (pc + 2 * fuse_length(fused) - 1) / FUSE_LINE; line++){
+            image->fused_lines[line / 8] |= 1 << (line % 8);
+        }
+    }
+}
+
+// length bytes of RAM from address (as placed by ram_span()) were written. The
+// image's table is shared and never changes, instead the fused operations that
+// read any of them are marked stale in this machine, see fuse_stale(). Lines no
+// fused operation reads from return right away, which is every write to plain data.
+static inline void fuse_invalidate(chip8_t *chip8, const uint32_t address, const uint32_t length){
+    const uint32_t first = address & RAM_MASK;
+    const uint32_t last = first + length - 1 > RAM_MASK ? RAM_MASK : first + length - 1;
+    bool hit = false;
+    for(uint32_t line = first / FUSE_LINE; line <= last / FUSE_LINE; line++){
+        hit |= chip8->image->fused_lines[line / 8] & (1 << (line % 8));
+    }
+    if(!hit) return;
+
+    for(uint32_t pc = first >= FUSE_WINDOW ? first - FUSE_WINDOW + 1 : 0; pc <= last; pc++){
+        chip8->fused_stale[pc / 8] |= 1 << (pc % 8);
+    }
+}
+
+// Was the fused operation at pc invalidated since reset? It then runs unfused.
+static inline ALWAYS_INLINE bool fuse_stale(const chip8_t *chip8, const uint32_t pc){
+    return (chip8->fused_stale[pc / 8] >> (pc % 8)) & 1;
+}
+
+// Build the image of rom_size bytes of ROM loaded at the entry point, without
+// touching the filesystem or allocating
+bool load_rom_image(rom_image_t *image, const config_t *config, const uint8_t *rom, const size_t rom_size){
+    const uint32_t entry_point = 0x200; //CHIP8 Roms will be loaded to 0x200
+    const uint8_t font[] = {
+        0xF0, 0x90, 0x90, 0x90, 0xF0,   // 0   
+        0x20, 0x60, 0x20, 0x20, 0x70,   // 1  
+        0xF0, 0x10, 0xF0, 0x80, 0xF0,   // 2 
+        0xF0, 0x10, 0xF0, 0x10, 0xF0,   // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10,   // 4    
+        0xF0, 0x80, 0xF0, 0x10, 0xF0,   // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0,   // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40,   // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0,   // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0,   // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90,   // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0,   // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0,   // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0,   // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0,   // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80,   // F
+    };
+
+    if(rom_size > RAM_MASK + 1 - entry_point) return false;
+
+    memset(image, 0, sizeof *image);
+
+    // Load font
+    memcpy(&image->ram[0], font, sizeof(font));
+
+    // Load ROM
+    memcpy(&image->ram[entry_point], rom, rom_size);
+    image->hash = hash_rom(rom, rom_size);
+    image->rom_size = rom_size;
+
+    image->quirks = config->quirks;
+    image->fusion = config->fusion;
+    if(config->fusion) build_fusion(image, config);
+
+    return true;
+}
+
+// Reset CHIP8 machine to a ROM image. Its render state and ROM name are kept.
+void reset_chip8(chip8_t *chip8, const config_t config, const rom_image_t *image){
+    uint32_t *pixel_color = chip8->pixel_color;
+    const char *rom_name = chip8->rom_name;
+
+    // Initialize entire CHIP8 machine
+    memset(chip8, 0, sizeof(chip8_t));
+    memcpy(chip8->ram, image->ram, sizeof chip8->ram);
+    chip8->image = image;
+    chip8->fused = image->fused;
+    chip8->pixel_color = pixel_color;
+    chip8->rom_name = rom_name;
+
+    // Set chip8 machine defaults
+    chip8->state = RUNNING; // Default machine state to on/running
+    chip8->PC = 0x200; // Start program counter at ROM entry point
+    chip8->wait_key = 0xFF; // FX0A not waiting on any key
+    chip8->rng = (uint32_t)rand() | 1; // xorshift state must be non zero
+    for(uint32_t i = 0; pixel_color && i < 64*32; i++){
+        pixel_color[i] = config.bg_color;
+    }
+}
+
+//Initialize CHIP8 Machine, loading rom_name into image
+bool init_chip8(chip8_t *chip8, rom_image_t *image, const config_t config, const char rom_name[]){
+    uint8_t rom_data[4096 - 0x200]; // Everything past the 0x200 entry point
+
+    // Open ROM file
+    FILE *rom = fopen(rom_name, "rb");
+    if(!rom){
+        SDL_Log("Rom file is %s is invalid or does not exist\n", rom_name);
+        return false;
+    }
+
+    // Get and check rom size
+    fseek(rom, 0, SEEK_END);
+    const size_t rom_size = ftell(rom);
+    const size_t max_size = sizeof rom_data;
+    rewind(rom);
+
+    if(rom_size > max_size){
+        SDL_Log("Rom file %s is too big! Rom size: %llu, Max size allowed: %llu\n", rom_name, (long long unsigned)rom_size, (long long unsigned)max_size);
+        fclose(rom);
+        return false;
+    }
+
+    // Read ROM
+    if (rom_size > 0 && fread(rom_data, rom_size, 1, rom) != 1){
+        SDL_Log("Could not read ROM file %s into CHIP8 memory\n", rom_name);
+        fclose(rom);
+        return false;
+    }
+
+    fclose(rom);
+
+    load_rom_image(image, &config, rom_data, rom_size);
+    reset_chip8(chip8, config, image);
+    chip8->rom_name = rom_name; // Set ROM name
+
+    return true;
+}
+
+// The image among count already built that is identical to image, else image
+const rom_image_t *share_rom_image(const rom_image_t *images, const uint32_t count, const rom_image_t *image){
+    for(uint32_t i = 0; i < count; i++){
+        if(images[i].hash == image->hash && images[i].quirks == image->quirks && images[i].fusion == image->fusion &&
+           images[i].rom_size == image->rom_size && memcmp(images[i].ram, image->ram, sizeof image->ram) == 0){
+            return &images[i];
+        }
+    }
+    return image;
+}
+
+// Copy machine state, e.g. for run-ahead snapshots. The copy shares the ROM
+// image and render state.
+void copy_chip8(chip8_t *dst, const chip8_t *src){
+    memcpy(dst, src, sizeof *dst);
+}
+
+// Arena of up to capacity zeroed machines, see alloc_machine()
+bool init_machine_arena(machine_arena_t *arena, const uint32_t capacity){
+    arena->stride = (sizeof(chip8_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    arena->capacity = capacity;
+    arena->used = 0;
+    arena->block = calloc(1, (size_t)capacity * arena->stride + CACHE_LINE - 1);
+    if(!arena->block){
+        SDL_Log("Could not allocate %u machines\n", (unsigned)capacity);
+        return false;
+    }
+    arena->slots = (uint8_t *)(((uintptr_t)arena->block + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+    return true;
+}
+
+// Next machine slot, cache line aligned and zeroed; NULL once all are handed out
+chip8_t *alloc_machine(machine_arena_t *arena){
+    if(arena->used == arena->capacity) return NULL;
+    return (chip8_t *)&arena->slots[arena->used++ * arena->stride];
+}
+
+// Release every machine of the arena at once
+void close_machine_arena(machine_arena_t *arena){
+    free(arena->block);
+    memset(arena, 0, sizeof *arena);
+}
+
+// xorshift32, deterministic given the machine state
+static inline uint8_t chip8_rand(chip8_t *chip8){
+    chip8->rng ^= chip8->rng << 13;
+    chip8->rng ^= chip8->rng >> 17;
+    chip8->rng ^= chip8->rng << 5;
+    return chip8->rng & 0xFF;
+}
+
+// Hardened accessors for the interpreter: out of range indices are masked into
+// range and counted in chip8->violations, so the hot path never branches on them
+
+// length (<= RAM_GUARD) bytes of RAM from address, counted once per instruction.
+// The start address wraps to RAM_MASK and bytes past the end land in the guard
+// area, so the bytes stay contiguous and need no per byte masking.
+static inline ALWAYS_INLINE uint8_t *ram_span(chip8_t *chip8, const uint32_t address, const uint32_t length){
+    chip8->violations.ram += address + length > RAM_MASK + 1;
+    return &chip8->ram[address & RAM_MASK];
+}
+
+// Stack ring of STACK_DEPTH entries. sp counts modulo 2 * STACK_DEPTH, so pushing
+// past STACK_DEPTH overwrites the oldest entries and popping an empty stack
+// leaves a full (wrapped) one; both are counted and stay deterministic
+static inline ALWAYS_INLINE void stack_push(chip8_t *chip8, const uint16_t address){
+    chip8->violations.stack_overflow += chip8->sp >= STACK_DEPTH;
+    chip8->stack[chip8->sp & STACK_MASK] = address;
+    chip8->sp = (chip8->sp + 1) & SP_MASK;
+}
+
+static inline ALWAYS_INLINE uint16_t stack_pop(chip8_t *chip8){
+    chip8->violations.stack_underflow += chip8->sp == 0;
+    chip8->sp = (chip8->sp - 1) & SP_MASK;
+    return chip8->stack[chip8->sp & STACK_MASK];
+}
+
+// Keypad state for key, masked to 4 bits
+static inline ALWAYS_INLINE bool key_down(chip8_t *chip8, const uint8_t key){
+    chip8->violations.keypad += key > 0xF;
+    return chip8->keypad[key & 0xF];
+}
+
+uint32_t count_violations(const violations_t *violations){
+    return violations->ram + violations->stack_overflow + violations->stack_underflow + violations->keypad;
+}
+
+void print_violations(const chip8_t *chip8){
+    const violations_t *v = &chip8->violations;
+    printf("Memory safety violations: %u RAM, %u stack overflow, %u stack underflow, %u keypad\n",
+           (unsigned)v->ram, (unsigned)v->stack_overflow, (unsigned)v->stack_underflow, (unsigned)v->keypad);
+}
+
+void final_cleanup(const sdl_t sdl){
+    SDL_DestroyRenderer(sdl.renderer); // Destroy renderer
+    SDL_DestroyWindow(sdl.window); // Destroy window
+    SDL_CloseAudioDevice(sdl.dev); // Close audio device
+    SDL_Quit(); // Shut down SDL subsystem
+}
+
+// Clear screen / SDl Window to background color
+void clear_screen(const sdl_t sdl, const config_t config){
+    const uint8_t r = (config.bg_color >> 24) & 0xFF;
+    const uint8_t g = (config.bg_color >> 16) & 0xFF;
+    const uint8_t b = (config.bg_color >> 8) & 0xFF;
+    const uint8_t a = (config.bg_color >> 0) & 0xFF;
+
+    SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+    SDL_RenderClear(sdl.renderer);
+}
+
+// Pixel i = y * 64 + x of a packed display, see chip8_t
+static inline bool display_pixel(const uint64_t *display, const uint32_t i){
+    return (display[i / 64] >> (63 - i % 64)) & 1;
+}
+
+// Lerp each CHIP8 pixel's draw color towards foreground/background
+void update_pixel_colors(const config_t config, chip8_t *chip8){
+    for(uint32_t i = 0; i < 64*32; i++){
+        const uint32_t target = display_pixel(chip8->display, i) ? config.fg_color : config.bg_color;
+        if(chip8->pixel_color[i] != target){
+            // Lerp color to foreground/background color
+            chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], target, config.color_lerp_rate);
+        }
+    }
+}
+
+// Draw the CHIP8 display into the renderer, presented by the caller after any overlay
+void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8){
+    SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
+    // Grab color values ot draw
+
+    /*const uint8_t fg_r = (config.fg_color >> 24) & 0xFF;
+    const uint8_t fg_g = (config.fg_color >> 16) & 0xFF;
+    const uint8_t fg_b = (config.fg_color >> 8) & 0xFF;
+    const uint8_t fg_a = (config.fg_color >> 0) & 0xFF;*/
+
+    const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
+    const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
+    const uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
+    const uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
+
+    update_pixel_colors(config, chip8);
+
+    for(uint32_t i = 0; i < 64*32; i++){
+        // Translate 1D index i value to 2D X/Y Coordinates
+        rect.x = (i % config.window_width) * config.scale_factor;
+        rect.y = (i / config.window_width) * config.scale_factor;
+
+        const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
+        const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
+        const uint8_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
+        const uint8_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+
+        SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+        SDL_RenderFillRect(sdl.renderer, &rect);
+
+        // If user requested drawing pixel outlines, draw those here
+        if(display_pixel(chip8->display, i) && config.pixel_outlines){
+            SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
+            SDL_RenderDrawRect(sdl.renderer, &rect);
+        }
+    }
+}
+
+// Fill count pixels with one color, 4 pixels per SSE2 store when available
+static inline void raster_fill(uint32_t *dst, const uint32_t color, const uint32_t count){
+    uint32_t i = 0;
+#ifdef __SSE2__
+    const __m128i c = _mm_set1_epi32((int32_t)color);
+    for(; i + 4 <= count; i += 4){
+        _mm_storeu_si128((__m128i *)&dst[i], c);
+    }
+#endif
+    for(; i < count; i++){
+        dst[i] = color;
+    }
+}
+
+// Halve RGB of count pixels, alpha is kept
+static inline void raster_darken(uint32_t *dst, const uint32_t count){
+    uint32_t i = 0;
+#ifdef __SSE2__
+    const __m128i rgb_mask = _mm_set1_epi32(0x7F7F7F00);
+    const __m128i a_mask = _mm_set1_epi32(0x000000FF);
+    for(; i + 4 <= count; i += 4){
+        const __m128i px = _mm_loadu_si128((const __m128i *)&dst[i]);
+        const __m128i half = _mm_and_si128(_mm_srli_epi32(px, 1), rgb_mask);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_or_si128(half, _mm_and_si128(px, a_mask)));
+    }
+#endif
+    for(; i < count; i++){
+        dst[i] = ((dst[i] >> 1) & 0x7F7F7F00) | (dst[i] & 0xFF);
+    }
+}
+
+// Integer scale a w x h color grid into out. Cells whose pixel is on in the
+// packed display outline (w = 64 only) get a 1 pixel border in outline_color,
+// same as SDL_RenderDrawRect in update_screen().
+void raster_expand(const uint32_t *colors, const uint64_t *outline, const uint32_t outline_color,
+                   const uint32_t w, const uint32_t h, const uint32_t scale, uint32_t *out){
+    const uint32_t out_w = w * scale;
+
+    for(uint32_t y = 0; y < h; y++){
+        uint32_t *row = &out[y * scale * out_w];
+        bool any_outline = false;
+
+        // Build the first output row for this CHIP8 row
+        for(uint32_t x = 0; x < w; x++){
+            const uint32_t i = y * w + x;
+            uint32_t *cell = &row[x * scale];
+
+            if(outline && display_pixel(outline, i)){
+                cell[0] = outline_color;
+                raster_fill(&cell[1], colors[i], scale - 2);
+                cell[scale - 1] = outline_color;
+                any_outline = true;
+            }
+            else{
+                raster_fill(cell, colors[i], scale);
+            }
+        }
+
+        // Every scaled row is a copy of the first
+        for(uint32_t r = 1; r < scale; r++){
+            memcpy(&row[r * out_w], row, out_w * sizeof *row);
+        }
+
+        // Top and bottom edges of outlined cells
+        if(any_outline){
+            for(uint32_t x = 0; x < w; x++){
+                if(!display_pixel(outline, y * w + x)) continue;
+                raster_fill(&row[x * scale], outline_color, scale);
+                raster_fill(&row[(scale - 1) * out_w + x * scale], outline_color, scale);
+            }
+        }
+    }
+}
+
+// Scale2x/EPX: double a w x h color grid, smoothing diagonal edges
+void raster_scale2x(const uint32_t *src, const uint32_t w, const uint32_t h, uint32_t *dst){
+    for(uint32_t y = 0; y < h; y++){
+        for(uint32_t x = 0; x < w; x++){
+            const uint32_t P = src[y * w + x];
+            const uint32_t A = src[(y > 0 ? y - 1 : y) * w + x];         // Up
+            const uint32_t B = src[y * w + (x < w - 1 ? x + 1 : x)];     // Right
+            const uint32_t C = src[y * w + (x > 0 ? x - 1 : x)];         // Left
+            const uint32_t D = src[(y < h - 1 ? y + 1 : y) * w + x];     // Down
+
+            uint32_t *out = &dst[(2 * y) * (2 * w) + 2 * x];
+            out[0] = (C == A && C != D && A != B) ? A : P;
+            out[1] = (A == B && A != C && B != D) ? B : P;
+            out[2 * w] = (D == C && D != B && C != A) ? C : P;
+            out[2 * w + 1] = (B == D && B != A && D != C) ? D : P;
+        }
+    }
+}
+
+// Software render display/pixel_color into an RGBA8888 image of
+// (64 * scale) x (32 * scale) pixels, no SDL/GPU needed.
+// Scale2x needs an even scale and replaces pixel outlines; odd scales fall
+// back to plain scaling.
+void rasterize(const uint64_t *display, const uint32_t *pixel_color, const config_t *config,
+               const uint32_t scale, uint32_t *out){
+    const uint32_t w = config->window_width;
+    const uint32_t h = config->window_height;
+
+    if(config->raster_filter == FILTER_SCALE2X && scale % 2 == 0){
+        uint32_t doubled[2*64 * 2*32];
+        raster_scale2x(pixel_color, w, h, doubled);
+        raster_expand(doubled, NULL, 0, 2 * w, 2 * h, scale / 2, out);
+    }
+    else{
+        const uint64_t *outline = (config->pixel_outlines && scale >= 2) ? display : NULL;
+        raster_expand(pixel_color, outline, config->bg_color, w, h, scale, out);
+    }
+
+    if(config->raster_filter == FILTER_SCANLINES){
+        const uint32_t out_w = w * scale;
+        for(uint32_t r = 1; r < h * scale; r += 2){
+            raster_darken(&out[r * out_w], out_w);
+        }
+    }
+}
+
+// Software render the current frame at scale_factor and save it as
+// binary PPM (.ppm, RGB) or PAM (.pam, RGBA)
+bool save_screenshot(const chip8_t *chip8, const config_t config, const char *path){
+    const uint32_t width = config.window_width * config.scale_factor;
+    const uint32_t height = config.window_height * config.scale_factor;
+    const char *ext = strrchr(path, '.');
+    const bool alpha = ext && strcmp(ext, ".pam") == 0;
+
+    uint32_t *image = malloc(width * height * sizeof *image);
+    uint8_t *bytes = malloc(width * height * 4);
+    FILE *file = fopen(path, "wb");
+    if(!image || !bytes || !file){
+        SDL_Log("Could not write screenshot %s\n", path);
+        free(image);
+        free(bytes);
+        if(file) fclose(file);
+        return false;
+    }
+
+    rasterize(chip8->display, chip8->pixel_color, &config, config.scale_factor, image);
+
+    const uint32_t channels = alpha ? 4 : 3;
+    for(uint32_t i = 0; i < width * height; i++){
+        for(uint32_t c = 0; c < channels; c++){
+            bytes[i * channels + c] = (image[i] >> (24 - 8 * c)) & 0xFF;
+        }
+    }
+
+    if(alpha){
+        fprintf(file, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                (unsigned)width, (unsigned)height);
+    }
+    else{
+        fprintf(file, "P6\n%u %u\n255\n", (unsigned)width, (unsigned)height);
+    }
+    fwrite(bytes, width * height * channels, 1, file);
+
+    fclose(file);
+    free(image);
+    free(bytes);
+    return true;
+}
+
+// GIF LZW bit packer, codes are written LSB first into 255 byte sub-blocks
+typedef struct {
+    FILE *file;
+    uint32_t bits; // Pending bits not yet written
+    uint32_t bit_count;
+    uint8_t block[255];
+    uint32_t block_len;
+} gif_bits_t;
+
+#define GIF_HASH_SIZE 8192 // Power of 2, more than 2x the 4096 LZW codes
+
+void gif_put_code(gif_bits_t *out, const uint32_t code, const uint32_t code_size){
+    out->bits |= code << out->bit_count;
+    out->bit_count += code_size;
+
+    while(out->bit_count >= 8){
+        out->block[out->block_len++] = out->bits & 0xFF;
+        out->bits >>= 8;
+        out->bit_count -= 8;
+
+        if(out->block_len == sizeof out->block){
+            fputc(out->block_len, out->file);
+            fwrite(out->block, out->block_len, 1, out->file);
+            out->block_len = 0;
+        }
+    }
+}
+
+// LZW compress 8-bit palette indices into GIF image data sub-blocks
+void gif_write_lzw(FILE *file, const uint8_t *indices, const uint32_t count){
+    static int32_t keys[GIF_HASH_SIZE]; // (prefix << 8 | index), -1 when empty
+    static uint16_t codes[GIF_HASH_SIZE];
+    const uint32_t clear_code = 256;
+    const uint32_t eoi_code = 257;
+
+    gif_bits_t out = {.file = file};
+    uint32_t code_size = 9;
+    uint32_t next_code = 258;
+
+    fputc(8, file); // LZW minimum code size
+    memset(keys, 0xFF, sizeof keys);
+    gif_put_code(&out, clear_code, code_size);
+
+    uint32_t prefix = indices[0];
+    for(uint32_t i = 1; i < count; i++){
+        const int32_t key = (int32_t)((prefix << 8) | indices[i]);
+        uint32_t slot = (key * 2654435761u) & (GIF_HASH_SIZE - 1);
+        while(keys[slot] != -1 && keys[slot] != key){
+            slot = (slot + 1) & (GIF_HASH_SIZE - 1);
+        }
+
+        if(keys[slot] == key){
+            // String already in dictionary, keep extending it
+            prefix = codes[slot];
+            continue;
+        }
+
+        gif_put_code(&out, prefix, code_size);
+        if(next_code < 4096){
+            if(next_code == (1u << code_size)) code_size++;
+            keys[slot] = key;
+            codes[slot] = next_code++;
+        }
+        else{
+            // Dictionary full, start over
+            gif_put_code(&out, clear_code, code_size);
+            memset(keys, 0xFF, sizeof keys);
+            code_size = 9;
+            next_code = 258;
+        }
+        prefix = indices[i];
+    }
+
+    gif_put_code(&out, prefix, code_size);
+    gif_put_code(&out, eoi_code, code_size);
+    if(out.bit_count > 0) gif_put_code(&out, 0, 8 - out.bit_count);
+    if(out.block_len > 0){
+        fputc(out.block_len, file);
+        fwrite(out.block, out.block_len, 1, file);
+    }
+    fputc(0, file); // Block terminator
+}
+
+// Map a pixel color to its GIF palette index. Every pixel_color lies on the
+// line between bg_color and fg_color (see update_pixel_colors), so the palette
+// is 256 steps along that line and the index is how far along the pixel is.
+uint8_t gif_palette_index(const uint32_t color, const uint32_t bg_color, const uint32_t fg_color){
+    int32_t best_range = 0;
+    int32_t best_offset = 0;
+
+    for(uint32_t shift = 8; shift <= 24; shift += 8){
+        const int32_t bg = (bg_color >> shift) & 0xFF;
+        const int32_t range = (int32_t)((fg_color >> shift) & 0xFF) - bg;
+        if(abs(range) > abs(best_range)){
+            best_range = range;
+            best_offset = (int32_t)((color >> shift) & 0xFF) - bg;
+        }
+    }
+
+    if(best_range == 0) return 0;
+    const int32_t index = best_offset * 255 / best_range;
+    return index < 0 ? 0 : index > 255 ? 255 : (uint8_t)index;
+}
+
+// Write one dequeued frame in the capture format (writer thread only)
+void capture_write_frame(capture_t *capture, const capture_frame_t *frame){
+    const uint32_t count = capture->width * capture->height;
+
+    rasterize(frame->display, frame->pixels, &capture->config, capture->config.capture_scale, capture->scaled);
+
+    switch(capture->format){
+        case CAPTURE_Y4M: {
+            // BT.601 limited range, full resolution chroma (C444)
+            uint8_t *planes = capture->bytes;
+            for(uint32_t i = 0; i < count; i++){
+                const int32_t r = (capture->scaled[i] >> 24) & 0xFF;
+                const int32_t g = (capture->scaled[i] >> 16) & 0xFF;
+                const int32_t b = (capture->scaled[i] >> 8) & 0xFF;
+                planes[i] = 16 + ((66*r + 129*g + 25*b + 128) >> 8);
+                planes[count + i] = 128 + ((-38*r - 74*g + 112*b + 128) >> 8);
+                planes[2*count + i] = 128 + ((112*r - 94*g - 18*b + 128) >> 8);
+            }
+            for(uint32_t i = 0; i <= frame->repeat; i++){
+                fputs("FRAME\n", capture->file);
+                fwrite(planes, 3 * count, 1, capture->file);
+            }
+            break;
+        }
+
+        case CAPTURE_RGBA: {
+            uint8_t *bytes = capture->bytes;
+            for(uint32_t i = 0; i < count; i++){
+                bytes[4*i + 0] = (capture->scaled[i] >> 24) & 0xFF;
+                bytes[4*i + 1] = (capture->scaled[i] >> 16) & 0xFF;
+                bytes[4*i + 2] = (capture->scaled[i] >> 8) & 0xFF;
+                bytes[4*i + 3] = (capture->scaled[i] >> 0) & 0xFF;
+            }
+            for(uint32_t i = 0; i <= frame->repeat; i++){
+                fwrite(bytes, 4 * count, 1, capture->file);
+            }
+            break;
+        }
+
+        case CAPTURE_GIF: {
+            // GIF delays are in 1/100 s and viewers clamp anything under 2,
+            // so frames shorter than that are folded into the next one.
+            const uint32_t duration = capture->gif_carry + (frame->repeat + 1) * 100;
+            const uint32_t delay = duration / 60;
+            if(delay < 2){
+                capture->gif_carry = duration;
+                break;
+            }
+            capture->gif_carry = duration % 60;
+
+            uint8_t *indices = capture->bytes;
+            for(uint32_t i = 0; i < count; i++){
+                indices[i] = gif_palette_index(capture->scaled[i], capture->config.bg_color, capture->config.fg_color);
+            }
+
+            const uint16_t gif_delay = delay > UINT16_MAX ? UINT16_MAX : delay;
+            const uint8_t gce[] = {
+                0x21, 0xF9, 0x04, 0x04, // Graphic control extension, disposal: keep
+                gif_delay & 0xFF, gif_delay >> 8, 0x00, 0x00,
+            };
+            const uint8_t descriptor[] = {
+                0x2C, 0, 0, 0, 0, // Image at 0,0, full logical screen size
+                capture->width & 0xFF, capture->width >> 8,
+                capture->height & 0xFF, capture->height >> 8,
+                0x00, // Use global color table
+            };
+            fwrite(gce, sizeof gce, 1, capture->file);
+            fwrite(descriptor, sizeof descriptor, 1, capture->file);
+            gif_write_lzw(capture->file, indices, count);
+            break;
+        }
+    }
+}
+
+// Capture writer thread, all disk I/O happens here
+int capture_thread(void *data){
+    capture_t *capture = (capture_t *) data;
+
+    SDL_LockMutex(capture->lock);
+    while(true){
+        while(capture->head == capture->tail && !capture->done){
+            SDL_CondWait(capture->cond, capture->lock);
+        }
+        if(capture->head == capture->tail) break; // Done and drained
+
+        // Producer never touches the head slot while it is queued
+        const capture_frame_t *frame = &capture->queue[capture->head % CAPTURE_QUEUE_LEN];
+        SDL_UnlockMutex(capture->lock);
+
+        capture_write_frame(capture, frame);
+
+        SDL_LockMutex(capture->lock);
+        capture->head++;
+        SDL_CondSignal(capture->cond);
+    }
+    SDL_UnlockMutex(capture->lock);
+
+    return 0;
+}
+
+// Hand the pending frame to the writer thread. Never blocks unless wait is set;
+// when the queue is full the frame is counted as a repeat of the newest queued
+// frame so capture timing stays correct.
+void capture_enqueue(capture_t *capture, const bool wait){
+    SDL_LockMutex(capture->lock);
+
+    while(wait && capture->tail - capture->head == CAPTURE_QUEUE_LEN){
+        SDL_CondWait(capture->cond, capture->lock);
+    }
+
+    if(capture->tail - capture->head == CAPTURE_QUEUE_LEN){
+        capture->queue[(capture->tail - 1) % CAPTURE_QUEUE_LEN].repeat += capture->pending.repeat + 1;
+        capture->frames_dropped++;
+    }
+    else{
+        capture->queue[capture->tail % CAPTURE_QUEUE_LEN] = capture->pending;
+        capture->tail++;
+        capture->frames_queued++;
+        SDL_CondSignal(capture->cond);
+    }
+
+    SDL_UnlockMutex(capture->lock);
+}
+
+// Start capturing to config.capture_file, format picked from file extension
+bool init_capture(capture_t *capture, const config_t config){
+    const char *ext = strrchr(config.capture_file, '.');
+    if(ext && strcmp(ext, ".y4m") == 0){
+        capture->format = CAPTURE_Y4M;
+    }
+    else if(ext && (strcmp(ext, ".rgba") == 0 || strcmp(ext, ".raw") == 0)){
+        capture->format = CAPTURE_RGBA;
+    }
+    else if(ext && strcmp(ext, ".gif") == 0){
+        capture->format = CAPTURE_GIF;
+    }
+    else{
+        SDL_Log("Capture file %s must end in .y4m, .rgba, .raw or .gif\n", config.capture_file);
+        return false;
+    }
+
+    capture->file = fopen(config.capture_file, "wb");
+    if(!capture->file){
+        SDL_Log("Could not open capture file %s\n", config.capture_file);
+        return false;
+    }
+
+    capture->config = config;
+    capture->width = config.window_width * config.capture_scale;
+    capture->height = config.window_height * config.capture_scale;
+
+    if(capture->format == CAPTURE_Y4M){
+        fprintf(capture->file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C444\n",
+                (unsigned)capture->width, (unsigned)capture->height);
+    }
+    else if(capture->format == CAPTURE_GIF){
+        if(capture->width > UINT16_MAX || capture->height > UINT16_MAX){
+            SDL_Log("Capture scale %u is too big for GIF\n", (unsigned)config.capture_scale);
+            return false;
+        }
+
+        const uint8_t header[] = {
+            'G', 'I', 'F', '8', '9', 'a',
+            capture->width & 0xFF, capture->width >> 8, // Logical screen size
+            capture->height & 0xFF, capture->height >> 8,
+            0xF7, 0, 0, // 256 entry global color table
+        };
+        fwrite(header, sizeof header, 1, capture->file);
+
+        for(uint32_t i = 0; i < 256; i++){
+            const uint32_t color = color_lerp(config.bg_color, config.fg_color, i / 255.0f);
+            fputc((color >> 24) & 0xFF, capture->file);
+            fputc((color >> 16) & 0xFF, capture->file);
+            fputc((color >> 8) & 0xFF, capture->file);
+        }
+
+        // NETSCAPE2.0 extension, loop forever
+        const uint8_t loop[] = {
+            0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+            0x03, 0x01, 0x00, 0x00, 0x00,
+        };
+        fwrite(loop, sizeof loop, 1, capture->file);
+    }
+
+    capture->queue = calloc(CAPTURE_QUEUE_LEN, sizeof *capture->queue);
+    capture->scaled = malloc(capture->width * capture->height * sizeof *capture->scaled);
+    capture->bytes = malloc(capture->width * capture->height * 4);
+    capture->lock = SDL_CreateMutex();
+    capture->cond = SDL_CreateCond();
+    if(!capture->queue || !capture->scaled || !capture->bytes || !capture->lock || !capture->cond){
+        SDL_Log("Could not allocate capture queue\n");
+        return false;
+    }
+
+    capture->thread = SDL_CreateThread(capture_thread, "capture", capture);
+    if(!capture->thread){
+        SDL_Log("Could not create capture thread %s\n", SDL_GetError());
+        return false;
+    }
+
+    return true;
+}
+
+// Offer the current frame to the capture, identical consecutive frames are
+// only counted, not copied or queued
+void capture_frame(capture_t *capture, const chip8_t *chip8){
+    capture->frames_seen++;
+
+    if(capture->has_pending &&
+       memcmp(capture->pending.pixels, chip8->pixel_color, sizeof capture->pending.pixels) == 0){
+        capture->pending.repeat++;
+        return;
+    }
+
+    if(capture->has_pending) capture_enqueue(capture, false);
+
+    memcpy(capture->pending.pixels, chip8->pixel_color, sizeof capture->pending.pixels);
+    memcpy(capture->pending.display, chip8->display, sizeof chip8->display);
+    capture->pending.repeat = 0;
+    capture->has_pending = true;
+}
+
+// Flush remaining frames, stop writer thread and close capture file
+void close_capture(capture_t *capture){
+    if(capture->has_pending) capture_enqueue(capture, true);
+
+    SDL_LockMutex(capture->lock);
+    capture->done = true;
+    SDL_CondSignal(capture->cond);
+    SDL_UnlockMutex(capture->lock);
+    SDL_WaitThread(capture->thread, NULL);
+
+    if(capture->format == CAPTURE_GIF) fputc(0x3B, capture->file); // GIF trailer
+    fclose(capture->file);
+
+    SDL_DestroyCond(capture->cond);
+    SDL_DestroyMutex(capture->lock);
+    free(capture->queue);
+    free(capture->scaled);
+    free(capture->bytes);
+
+    printf("Captured %llu frames (%llu distinct, %llu merged when writer fell behind)\n",
+           (long long unsigned)capture->frames_seen,
+           (long long unsigned)capture->frames_queued,
+           (long long unsigned)capture->frames_dropped);
+}
+
+// Create and map the shared memory segment config.shm_name
+bool init_shm_export(shm_export_t *export, const config_t config){
+#ifdef CHIP8_POSIX
+    const int fd = shm_open(config.shm_name, O_CREAT | O_RDWR, 0600);
+    if(fd < 0){
+        SDL_Log("Could not open shared memory %s\n", config.shm_name);
+        return false;
+    }
+
+    if(ftruncate(fd, sizeof(chip8_shm_t)) != 0){
+        SDL_Log("Could not size shared memory %s\n", config.shm_name);
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(NULL, sizeof(chip8_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // Mapping stays valid
+    if(mem == MAP_FAILED){
+        SDL_Log("Could not map shared memory %s\n", config.shm_name);
+        return false;
+    }
+
+    export->shm = (chip8_shm_t *) mem;
+    export->name = config.shm_name;
+    memset(export->shm, 0, sizeof(chip8_shm_t));
+    export->shm->version = CHIP8_SHM_VERSION;
+    __atomic_store_n(&export->shm->magic, CHIP8_SHM_MAGIC, __ATOMIC_RELEASE);
+    return true;
+#else
+    (void) export;
+    SDL_Log("Shared memory export %s is only supported on POSIX systems\n", config.shm_name);
+    return false;
+#endif
+}
+
+// Publish one frame of machine state under the seqlock, never waits on readers
+void publish_shm(shm_export_t *export, const chip8_t *chip8){
+    chip8_shm_t *shm = export->shm;
+    const uint32_t seq = shm->seq; // Only this thread writes seq
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->frame++;
+    memcpy(shm->pixel_color, chip8->pixel_color, sizeof shm->pixel_color);
+    for(uint32_t i = 0; i < sizeof shm->display; i++){
+        shm->display[i] = display_pixel(chip8->display, i); // The shared layout keeps a byte per pixel
+    }
+    memcpy(shm->stack, chip8->stack, sizeof chip8->stack);
+    shm->sp = chip8->sp;
+    shm->I = chip8->I;
+    shm->PC = chip8->PC;
+    memcpy(shm->V, chip8->V, sizeof shm->V);
+    shm->delay_timer = chip8->delay_timer;
+    shm->sound_timer = chip8->sound_timer;
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Copy reader supplied keys into the keypad when they sent new input,
+// returns true if the keypad changed
+bool poll_shm_input(shm_export_t *export, chip8_t *chip8){
+    const uint32_t input_seq = __atomic_load_n(&export->shm->input_seq, __ATOMIC_ACQUIRE);
+    if(input_seq == export->input_seq) return false;
+    export->input_seq = input_seq;
+
+    const uint16_t keys = __atomic_load_n(&export->shm->keys, __ATOMIC_RELAXED);
+    bool changed = false;
+    for(uint32_t k = 0; k < sizeof chip8->keypad; k++){
+        changed |= chip8->keypad[k] != ((keys >> k) & 1);
+        chip8->keypad[k] = (keys >> k) & 1;
+    }
+    return changed;
+}
+
+void close_shm_export(shm_export_t *export){
+#ifdef CHIP8_POSIX
+    munmap(export->shm, sizeof(chip8_shm_t));
+    shm_unlink(export->name);
+#endif
+    export->shm = NULL;
+}
+
+// Note a keypad event, SDL event timestamps are in ms since SDL_Init
+void latency_input(latency_t *latency, const uint32_t event_ms){
+    if(latency->pending_since) return; // Measure from the oldest unanswered event
+
+    const uint32_t now_ms = SDL_GetTicks();
+    const uint64_t age = (now_ms > event_ms) ? (uint64_t)(now_ms - event_ms) * SDL_GetPerformanceFrequency() / 1000 : 0;
+    latency->pending_since = SDL_GetPerformanceCounter() - age;
+}
+
+// Called right after a frame is presented. The first presented frame whose
+// display differs from the previous one completes a pending measurement.
+void latency_presented(latency_t *latency, const chip8_t *chip8){
+    if(memcmp(latency->last_display, chip8->display, sizeof chip8->display) == 0) return;
+    memcpy(latency->last_display, chip8->display, sizeof chip8->display);
+
+    if(!latency->pending_since) return;
+
+    const double ms = (double)(SDL_GetPerformanceCounter() - latency->pending_since) * 1000 / SDL_GetPerformanceFrequency();
+    latency->pending_since = 0;
+
+    if(latency->samples == 0 || ms < latency->min_ms) latency->min_ms = ms;
+    if(ms > latency->max_ms) latency->max_ms = ms;
+    latency->total_ms += ms;
+    latency->samples++;
+
+    const uint32_t bucket = (uint32_t)(ms * 2);
+    latency->histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+}
+
+// Latency at percentile p (0-100), from the histogram, in ms
+double latency_percentile(const latency_t *latency, const double p){
+    const uint64_t target = (uint64_t)(latency->samples * p / 100.0);
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < LATENCY_BUCKETS; i++){
+        seen += latency->histogram[i];
+        if(seen > target) return (i + 1) / 2.0;
+    }
+    return LATENCY_BUCKETS / 2.0;
+}
+
+void print_latency_stats(const latency_t *latency){
+    if(latency->samples == 0){
+        puts("Input latency: no key presses were followed by a changed frame");
+        return;
+    }
+
+    printf("Input latency over %llu key events: min %.1f ms, mean %.1f ms, p50 %.1f ms, p95 %.1f ms, max %.1f ms\n",
+           (long long unsigned)latency->samples, latency->min_ms, latency->total_ms / latency->samples,
+           latency_percentile(latency, 50), latency_percentile(latency, 95), latency->max_ms);
+}
+
+void init_pacer(frame_pacer_t *pacer){
+    *pacer = (frame_pacer_t){0};
+    pacer->period = SDL_GetPerformanceFrequency() / 60;
+    pacer->deadline = SDL_GetPerformanceCounter() + pacer->period;
+}
+
+// Should the frame just emulated be presented? Only when the renderer is
+// keeping up, or when max_skip presents in a row have already been dropped.
+bool pacer_should_present(frame_pacer_t *pacer, const uint32_t max_skip){
+    if(SDL_GetPerformanceCounter() <= pacer->deadline || pacer->skip_run >= max_skip){
+        pacer->skip_run = 0;
+        pacer->presented++;
+        return true;
+    }
+
+    pacer->skipped++;
+    pacer->skip_run++;
+    if(pacer->skip_run > pacer->longest_run) pacer->longest_run = pacer->skip_run;
+    return false;
+}
+
+// End of frame: sleep until the deadline when ahead, then move it one frame on.
+// A renderer slower than max_skip dropped presents can make up for only keeps
+// max_skip frames of debt, so the cap holds and game time slips instead.
+void pacer_end_frame(frame_pacer_t *pacer, const uint32_t max_skip){
+    const uint64_t now = SDL_GetPerformanceCounter();
+    if(now < pacer->deadline){
+        SDL_Delay((uint32_t)((pacer->deadline - now) * 1000 / SDL_GetPerformanceFrequency()));
+    }
+    else if(now - pacer->deadline > pacer->period * max_skip){
+        pacer->deadline = now - pacer->period * max_skip;
+        pacer->resyncs++;
+    }
+    pacer->deadline += pacer->period;
+}
+
+// Restart pacing from now, for when the loop was idle (paused, debugger stop)
+void pacer_hold(frame_pacer_t *pacer){
+    pacer->deadline = SDL_GetPerformanceCounter() + pacer->period;
+}
+
+void print_pacer_stats(const frame_pacer_t *pacer){
+    const uint64_t frames = pacer->presented + pacer->skipped;
+    if(frames == 0) return;
+
+    printf("Frame skip: %llu of %llu frames not presented (%.1f%%), longest run %u, %llu resyncs, "
+           "mean render %.2f ms\n", (long long unsigned)pacer->skipped, (long long unsigned)frames,
+           100.0 * pacer->skipped / frames, (unsigned)pacer->longest_run, (long long unsigned)pacer->resyncs,
+           pacer->presented ? pacer->render_ms / pacer->presented : 0.0);
+}
+
+// Milliseconds since a perf counter time
+static inline double elapsed_ms(const uint64_t since){
+    return (double)((SDL_GetPerformanceCounter() - since) * 1000) / SDL_GetPerformanceFrequency();
+}
+
+bool init_metrics(metrics_t *metrics, const config_t config){
+    *metrics = (metrics_t){0};
+    metrics->interval_start = metrics->last_frame = SDL_GetPerformanceCounter();
+
+    if(!config.metrics_file) return true;
+
+    metrics->file = (strcmp(config.metrics_file, "-") == 0) ? stdout : fopen(config.metrics_file, "w");
+    if(!metrics->file){
+        SDL_Log("Could not open metrics file %s\n", config.metrics_file);
+        return false;
+    }
+    return true;
+}
+
+// Account one ended frame, its frame time runs from the end of the previous one
+void metrics_frame(metrics_t *metrics, const double emulate_ms, const double render_ms, const double present_ms){
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const double frame_ms = (double)((now - metrics->last_frame) * 1000) / SDL_GetPerformanceFrequency();
+    metrics->last_frame = now;
+
+    const uint32_t bucket = (uint32_t)(frame_ms * 4);
+    metrics->histogram[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1]++;
+    if(frame_ms > metrics->max) metrics->max = frame_ms;
+
+    metrics->frames++;
+    metrics->emulate_ms += emulate_ms;
+    metrics->render_ms += render_ms;
+    metrics->present_ms += present_ms;
+}
+
+// Restart frame timing from now, for when the loop was idle (paused, debugger stop)
+void metrics_hold(metrics_t *metrics){
+    metrics->last_frame = SDL_GetPerformanceCounter();
+}
+
+// Frame time at percentile p (0-100) this interval, from the histogram, in ms.
+// A bucket's upper bound, but never more than the slowest frame seen.
+double metrics_percentile(const metrics_t *metrics, const double p){
+    const uint64_t target = (uint64_t)(metrics->frames * p / 100.0);
+    uint64_t seen = 0;
+    uint32_t i = 0;
+    while(i < METRICS_BUCKETS - 1 && (seen += metrics->histogram[i]) <= target) i++;
+    const double ms = (i + 1) / 4.0;
+    return ms < metrics->max ? ms : metrics->max;
+}
+
+// Close the interval once metrics_interval ms have passed: summarize it for the
+// HUD, write a --metrics line and start the next one. Returns true if it did.
+bool metrics_update(metrics_t *metrics, const config_t config, const frame_pacer_t *pacer, const uint64_t insts){
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    if(now - metrics->interval_start < (uint64_t)config.metrics_interval * freq / 1000 || metrics->frames == 0){
+        return false;
+    }
+
+    const double seconds = (double)(now - metrics->interval_start) / freq;
+    const uint32_t underruns = __atomic_load_n(&audio_stats.underruns, __ATOMIC_RELAXED);
+    metrics->seconds += seconds;
+    metrics->ips = (insts - metrics->insts_start) / seconds;
+    metrics->fps = (pacer->presented - metrics->presented_start) / seconds;
+    metrics->emulate = metrics->emulate_ms / metrics->frames;
+    metrics->render = metrics->render_ms / metrics->frames;
+    metrics->present = metrics->present_ms / metrics->frames;
+    metrics->p50 = metrics_percentile(metrics, 50);
+    metrics->p95 = metrics_percentile(metrics, 95);
+    metrics->p99 = metrics_percentile(metrics, 99);
+    metrics->dropped = pacer->skipped - metrics->skipped_start;
+    metrics->underruns = underruns - metrics->underruns_start;
+
+    if(metrics->file){
+        fprintf(metrics->file, "t=%.3f frames=%u ips=%.0f fps=%.1f emulate_ms=%.3f render_ms=%.3f present_ms=%.3f "
+                "frame_p50_ms=%.2f frame_p95_ms=%.2f frame_p99_ms=%.2f frame_max_ms=%.2f dropped=%llu underruns=%u\n",
+                metrics->seconds, (unsigned)metrics->frames, metrics->ips, metrics->fps, metrics->emulate,
+                metrics->render, metrics->present, metrics->p50, metrics->p95, metrics->p99, metrics->max,
+                (long long unsigned)metrics->dropped, (unsigned)metrics->underruns);
+        fflush(metrics->file);
+    }
+
+    // Next interval
+    metrics->interval_start = now;
+    metrics->frames = 0;
+    metrics->emulate_ms = metrics->render_ms = metrics->present_ms = metrics->max = 0;
+    memset(metrics->histogram, 0, sizeof metrics->histogram);
+    metrics->insts_start = insts;
+    metrics->presented_start = pacer->presented;
+    metrics->skipped_start = pacer->skipped;
+    metrics->underruns_start = underruns;
+    return true;
+}
+
+void close_metrics(metrics_t *metrics){
+    if(metrics->file && metrics->file != stdout) fclose(metrics->file);
+    metrics->file = NULL;
+}
+
+// 3x5 HUD font, row 0 in bits 14-12 and bit 2 of each row is the left column
+static const uint16_t hud_font[128] = {
+    ['0'] = 0x7B6F, ['1'] = 0x2C97, ['2'] = 0x73E7, ['3'] = 0x73CF, ['4'] = 0x5BC9, ['5'] = 0x79CF,
+    ['6'] = 0x79EF, ['7'] = 0x7249, ['8'] = 0x7BEF, ['9'] = 0x7BCF, ['A'] = 0x2BED, ['B'] = 0x6BAE,
+    ['C'] = 0x3923, ['D'] = 0x6B6E, ['E'] = 0x79A7, ['F'] = 0x79A4, ['G'] = 0x396B, ['H'] = 0x5BED,
+    ['I'] = 0x7497, ['J'] = 0x126A, ['K'] = 0x5BAD, ['L'] = 0x4927, ['M'] = 0x5FED, ['N'] = 0x6B6D,
+    ['O'] = 0x2B6A, ['P'] = 0x6BA4, ['Q'] = 0x2B73, ['R'] = 0x6BAD, ['S'] = 0x388E, ['T'] = 0x7492,
+    ['U'] = 0x5B6F, ['V'] = 0x5B6A, ['W'] = 0x5BFD, ['X'] = 0x5AAD, ['Y'] = 0x5A92, ['Z'] = 0x72A7,
+    ['.'] = 0x0002, [':'] = 0x0410, ['%'] = 0x52A5, ['/'] = 0x12A4, ['-'] = 0x01C0,
+};
+
+#define HUD_LINES 4
+#define HUD_COLUMNS 40
+
+// Overlay the last metrics interval in the top left corner, fg_color text on
+// a translucent bg_color box, drawn after update_screen() and before the present
+void draw_hud(const sdl_t sdl, const config_t config, const metrics_t *metrics){
+    char lines[HUD_LINES][HUD_COLUMNS + 1];
+    snprintf(lines[0], sizeof lines[0], "IPS %.0f FPS %.1f", metrics->ips, metrics->fps);
+    snprintf(lines[1], sizeof lines[1], "EMU %.2f DRAW %.2f PRESENT %.2f MS", metrics->emulate, metrics->render,
+             metrics->present);
+    snprintf(lines[2], sizeof lines[2], "P50/95/99 %.1f/%.1f/%.1f MAX %.1f MS", metrics->p50, metrics->p95,
+             metrics->p99, metrics->max);
+    snprintf(lines[3], sizeof lines[3], "DROPPED %llu UNDERRUNS %u", (long long unsigned)metrics->dropped,
+             (unsigned)metrics->underruns);
+
+    // A glyph takes 4x6 units with spacing, a unit is a fifth of a CHIP8 pixel
+    const int unit = config.scale_factor >= 5 ? (int)config.scale_factor / 5 : 1;
+    size_t columns = 0;
+    for(uint32_t i = 0; i < HUD_LINES; i++){
+        if(strlen(lines[i]) > columns) columns = strlen(lines[i]);
+    }
+
+    const SDL_Rect box = {.x = unit, .y = unit, .w = (int)(columns * 4 + 1) * unit, .h = (HUD_LINES * 6 + 1) * unit};
+    SDL_SetRenderDrawBlendMode(sdl.renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(sdl.renderer, (config.bg_color >> 24) & 0xFF, (config.bg_color >> 16) & 0xFF,
+                           (config.bg_color >> 8) & 0xFF, 0xC0);
+    SDL_RenderFillRect(sdl.renderer, &box);
+    SDL_SetRenderDrawBlendMode(sdl.renderer, SDL_BLENDMODE_NONE);
+
+    // All lit glyph cells in one batch
+    static SDL_Rect cells[HUD_LINES * HUD_COLUMNS * 15];
+    int count = 0;
+    for(uint32_t line = 0; line < HUD_LINES; line++){
+        for(uint32_t column = 0; lines[line][column]; column++){
+            const uint16_t glyph = hud_font[(uint8_t)lines[line][column] & 0x7F];
+            for(uint32_t bit = 0; bit < 15; bit++){
+                if(!(glyph & (0x4000 >> bit))) continue;
+                cells[count++] = (SDL_Rect){
+                    .x = box.x + (int)(column * 4 + 1 + bit % 3) * unit,
+                    .y = box.y + (int)(line * 6 + 1 + bit / 3) * unit,
+                    .w = unit, .h = unit,
+                };
+            }
+        }
+    }
+
+    SDL_SetRenderDrawColor(sdl.renderer, (config.fg_color >> 24) & 0xFF, (config.fg_color >> 16) & 0xFF,
+                           (config.fg_color >> 8) & 0xFF, 0xFF);
+    SDL_RenderFillRects(sdl.renderer, cells, count);
+}
+
+// Handle Input
+// CHIP8 keys go through config->keymap, by default:
+// CHIP8 Keypad     QWERTY
+// 123C             1234
+// 456D             qwer
+// 789E             asdf
+// A0BF             zxcv
+// Returns true if the machine was reset or its keypad changed. Keypad
+// changes are timestamped into latency when it is not NULL.
+bool handle_input(chip8_t *chip8, config_t *config, latency_t *latency){
+    bool changed = false;
+    SDL_Event event;
+    while(SDL_PollEvent(&event)){
+        bool keypad_before[16];
+        memcpy(keypad_before, chip8->keypad, sizeof keypad_before);
+
+        switch(event.type){
+            case SDL_QUIT:
+                // Exit window; End program
+                chip8->state = QUIT; // Will exit main loop
+                break;
+
+            case SDL_KEYDOWN:
+                switch(event.key.keysym.sym){
+                    case SDLK_ESCAPE:
+                        // Escape key;
+                        chip8->state = QUIT;
+                        break;
+                    case SDLK_SPACE:
+                        // Pause/Unpause emulator
+                        if(chip8->state == RUNNING){
+                            chip8->state = PAUSED;
+                            puts("==== PAUSED ====");
+                        }
+                        else{
+                            chip8->state = RUNNING;   
+                        }
+                        break;
+                     case SDLK_EQUALS:
+                        // "=" Reset CHIP8 machine for the current ROM
+                        reset_chip8(chip8, *config, chip8->image);
+                        changed = true;
+                        break;
+                    case SDLK_F1:
+                        // F1 Show/hide the performance HUD
+                        config->hud = !config->hud;
+                        break;
+                    case SDLK_j:
+                        // 'j' Decrease color lerp rate
+                        if(config->color_lerp_rate > 0.1){
+                            config->color_lerp_rate -= 0.1;
+                        }
+                        break;
+                    case SDLK_k:
+                        // 'j' Increase color lerp rate
+                        if(config->color_lerp_rate < 1.0){
+                            config->color_lerp_rate += 0.1;
+                        }
+                        break;
+                    case SDLK_o:
+                        // 'o' Decrease volume
+                        if(config->volume > 0){
+                            config->volume -= 500;
+                        }
+                        break;
+                    case SDLK_p:
+                        // 'p' Increase volume
+                        if(config->volume < INT16_MAX){
+                            config->volume += 500;
+                        }
+                        break;
+
+                    default:
+                        // CHIP8 keypad, through the keymap
+                        for(uint8_t key = 0; key < 16; key++){
+                            if(event.key.keysym.sym == config->keymap[key]) chip8->keypad[key] = true;
+                        }
+                        break;
+                }
+                break;
+
+            case SDL_KEYUP:
+                for(uint8_t key = 0; key < 16; key++){
+                    if(event.key.keysym.sym == config->keymap[key]) chip8->keypad[key] = false;
+                }
+                break;
+            default:
+                break;
+        }
+
+        if(memcmp(keypad_before, chip8->keypad, sizeof keypad_before) != 0){
+            changed = true;
+            if(latency) latency_input(latency, event.key.timestamp);
+        }
+    }
+
+    return changed;
+}
+
+#ifdef DEBUG
+void print_debug_info(chip8_t *chip8){
+    printf("Address: 0x%04X, Opcode: 0x%04X Desc: ",chip8->PC-2, chip8->inst.opcode);
+
+    // Emulate opcode
+    switch((chip8->inst.opcode >> 12) & 0x0F){
+        case 0x00:
+            if(chip8->inst.NN == 0xE0){
+                // 0x00E0: Clear screen
+                printf("Clear screen\n");
+            }
+            else if(chip8->inst.NN == 0xEE){
+                // 0x00EE: Return from subroutine
+                // set progrma address to last address from subroutine stack ("pop" it off the stack)
+                // so that next opcode will be gotten from address.
+                printf("Return from subroutine to address 0x%04X \n", chip8->stack[(chip8->sp - 1) & STACK_MASK]);
+            }
+            else{
+                printf("Unimplemented Opcode\n");
+            }
+            break;
+        case 0x01:
+
+            printf("Jump to address NNN (0x%04X)\n", chip8->inst.NNN);
+            break;
+        case 0x02:
+            // 0x2NNN: Call subroutine at NNN
+            // Store current address to return to on subroutine stack ("push" iton the stack)
+            // and set program counter to subroutine address so that the next opcode
+            // is gotten from there.
+
+            printf("Call subroutine at NNN (0x%04X)\n", chip8->inst.NNN);
+            break;
+        case 0x03:
+            printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",  chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
+            break;
+        case 0x04:
+            printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",  chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
+            break;
+        case 0x05:
+            printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",  chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+            break;
+        case 0x06:
+            // 0x6XNN: Set register V[X] to NN
+            printf("Set register V[%X] to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+            break;
+        case 0x0A:
+            // 0xANNN: Set I to NNN
+            printf("Set I to NNN (0x%04X)\n", chip8->inst.NNN);
+            break;
+        case 0x0D:
+            printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) from memory location I (0x%04X). Set VF = 1 if any pixels are turned off\n", 
+                chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I);
+            break;
+        case 0x07:
+            // 0x6XNN: Set register V[X] to NN
+            printf("Set register V%X to NN (0X%02X) += NN (0X%02X). Result: 0X%02X\n", 
+                chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->V[chip8->inst.X] + chip8->inst.NN);
+            break;
+        case 0x08:
+            switch(chip8->inst.N){
+                case 0:
+                    // 0x8XY0: Set register VX = VY
+                    printf("Set register V%X = V%X (0X%02X)\n", 
+                        chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
+                    break;
+                case 1:
+                    // 0x8XY1: Set register VX |= VY
+                    printf("Set register V%X (0x%02X) |= V%X (0X%02X); Result: 0X%02X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->inst.Y, chip8->V[chip8->inst.Y],
+                        chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
+                    break;
+                case 2:
+                    // 0x8XY2: Set register VX &= VY
+                    printf("Set register V%X (0x%02X) &= V%X (0X%02X); Result: 0X%02X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->inst.Y, chip8->V[chip8->inst.Y],
+                        chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
+                    break;
+                case 3:
+                    // 0x8XY3: Set register VX ^= VY
+                    printf("Set register V%X (0x%02X) ^= V%X (0X%02X); Result: 0X%02X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->inst.Y, chip8->V[chip8->inst.Y],
+                        chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
+                    break;
+                case 4:
+                    // 0x8XY4: Set register VX += VY
+                    printf("Set register V%X (0x%02X) += V%X (0X%02X), VF = 1 if carry; Result: 0X%02X, VF = %X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->inst.Y, chip8->V[chip8->inst.Y],
+                        chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y],
+                        ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
+                    break;
+                case 5:
+                    // 0x8XY5: Set register VX -= VY
+                    printf("Set register V%X (0x%02X) -= V%X (0X%02X), VF = 1 if no borrow; Result: 0X%02X, VF = %X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
                         chip8->inst.Y, chip8->V[chip8->inst.Y],
                         chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
                         (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
                     break;
                 case 6:
                     // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-                    printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result 0X%02X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->V[chip8->inst.X] & 1,
-                        chip8->V[chip8->inst.X] >> 1);
+                    printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result 0X%02X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->V[chip8->inst.X] & 1,
+                        chip8->V[chip8->inst.X] >> 1);
+                    break;
+                case 7:
+                    // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive)
+                    printf("Set register V%X = V%X (0x%02X) - V%X (0X%02X), VF = 1 if no borrow; Result: 0X%02X, VF = %X\n", 
+                        chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X],
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
+                        (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
+                    break;
+                case 0xE:
+                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+                    printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result 0X%02X\n", 
+                        chip8->inst.X, chip8->V[chip8->inst.X],
+                        chip8->V[chip8->inst.X] & (0x08) >> 7,
+                        chip8->V[chip8->inst.X] << 1);
+                    break;
+                default:
+                    // Wrong/unimplemented opcode
+                    break;
+            }
+            break;
+        case 0x09:
+            // 0x9XY0: Skip next instruction if VX != VY
+            printf("Set register V%X (0x%02X) != V%X (0X%02X), skip next instruction if true\n", 
+                chip8->inst.X, chip8->V[chip8->inst.X],
+                chip8->inst.Y, chip8->V[chip8->inst.Y]);
+            break;
+        case 0x0B:
+            // 0xBNNN: Jump to address v0 + NNN
+            printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
+                chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
+
+            break;
+        case 0x0C:
+            // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
+            printf("Set V%X = rand() %% 256 & NN (0x%02X)\n",
+                chip8->inst.X, chip8->inst.NN);
+
+            break;
+        case 0x0E:
+            if(chip8->inst.NN == 0x9E){
+                // 0xEX9E: Skip next instruction if key in VX is pressed
+                printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n",
+                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
+            }
+            else if(chip8->inst.NN == 0xA1){
+                printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n",
+                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
+            }
+            break;
+        case 0x0F:
+            switch(chip8->inst.NN){
+                case 0x0A:
+                    // 0xFX0A: VX = get_key(): Await until a keypress, an store in VX
+                    printf("Await until a key is pressed; Store key in V%X\n", chip8->inst.X);
+                    break;
+
+                case 0x1E:
+                    // 0xFX1E: I += VX; Add VX to register I. For non-Aniga CHIP8, does not affect VF
+                    printf("I (0x%04X) += V%X (0x%02X) Result (I): 0x%04X\n",
+                        chip8->I, chip8->inst.X, chip8->V[chip8->inst.X], chip8->I + chip8->V[chip8->inst.X]);
+                    break;
+                case 0x07:
+                    // 0xFX07: Set VX to delay timer value
+                    printf("Set V%X = delay timer value (0x%02X)\n", chip8->inst.X, chip8->delay_timer);
+                    break;
+                case 0x15:
+                    // 0xFX15: Set delay timer to VX
+                    printf("Set delay timer = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                case 0x18:
+                    // 0xFX18: Set sound timer to VX
+                    printf("Set delay timer = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                case 0x29:
+                    // 0xFX29: Set register I to location of sprite for digit VX
+                    printf("Set I to sprite location in memory for characters in V%X (0x%02X). Result(VX*5) = (0x%02X) \n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
+                    break;
+                case 0x33:
+                    // 0xFX33: Store BCD representation of VX in memory locations I, I+1, I+2
+                    printf("Store BCD representation of V%X (0x%02X) in memory locations I (0x%04X), I+1, I+2\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+                    break;
+                case 0x55:
+                    // 0xFX55: Store V0 to VX in memory starting at I
+                    printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04x)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+                    break;
+                case 0x65:
+                    // 0xFX65: Store V0 to VX in memory starting at I
+                    printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04x)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+                    break;
+                default:
+                    // Wrong/unimplemented opcode
+                    break;
+            }
+            break;
+
+        default:
+            printf("Unimplemented Opcode\n");
+            break;
+    }
+    
+}
+#endif
+
+static inline ALWAYS_INLINE void decode_instruction(instruction_t *inst, const uint16_t opcode){
+    inst->opcode = opcode;
+    //inst->category = (opcode >> 12) & 0x0F;
+    inst->NNN = opcode & 0x0FFF;
+    inst->NN = opcode & 0x0FF;
+    inst->N = opcode & 0x0F;
+    inst->X = (opcode >> 8) & 0x0F;
+    inst->Y = (opcode >> 4) & 0x0F;
+}
+
+// DXYN for the decoded chip8->inst, shared with the fused ANNN/DXYN. Each
+// sprite row is XORed into its display row in one go; pixels past the right
+// edge shift out of the word and rows past the bottom edge are not drawn.
+static inline ALWAYS_INLINE void draw_sprite(chip8_t *chip8, const config_t *config, const uint32_t quirks){
+    const uint8_t X_coord = chip8->V[chip8->inst.X] % config->window_width; // Rows are 64 pixels wide
+    const uint8_t Y_coord = chip8->V[chip8->inst.Y] % config->window_height;
+    const uint8_t *sprite = ram_span(chip8, chip8->I, chip8->inst.N);
+    const uint8_t rows = (Y_coord + chip8->inst.N > config->window_height) ? config->window_height - Y_coord : chip8->inst.N;
+
+    uint64_t collision = 0;
+    for(uint8_t i = 0; i < rows; i++){
+        const uint64_t bits = ((uint64_t)sprite[i] << 56) >> X_coord;
+        collision |= chip8->display[Y_coord + i] & bits;
+        chip8->display[Y_coord + i] ^= bits;
+    }
+    chip8->V[0xF] = collision != 0; // Carry flag set if any pixel was turned off
+
+    chip8->draw = true; // Will update screen on next 60 hz tick
+    if(quirks & QUIRK_DISPLAY_WAIT) chip8->vblank_wait = true;
+}
+
+// Skip the next instruction. Skipping the one at 0xFFE wraps PC to the start
+// of RAM, counted as a RAM violation like a BNNN past the end.
+static inline ALWAYS_INLINE void skip_instruction(chip8_t *chip8){
+    chip8->PC += 2;
+    chip8->violations.ram += chip8->PC > RAM_MASK;
+    chip8->PC &= RAM_MASK;
+}
+
+// FX65 for the decoded chip8->inst, shared with the fused FX1E/FX65
+static inline ALWAYS_INLINE void load_registers(chip8_t *chip8, const uint32_t quirks){
+    const uint8_t *load = ram_span(chip8, chip8->I, chip8->inst.X + 1);
+    for(uint8_t i = 0; i <= chip8->inst.X; i++){
+        chip8->V[i] = load[i];
+    }
+    if(quirks & QUIRK_MEMORY_INC_I){
+        chip8->I += chip8->inst.X + 1; // I left past the last register loaded
+    }
+}
+
+// Emulate 1 CHIP8 instruction with the given QUIRK_* flags.
+// Always inlined into the per-quirk interpreter instances below, so quirks is
+// a compile time constant there and the quirk checks fold away.
+static inline ALWAYS_INLINE void emulate_instruction(chip8_t *chip8, const config_t *config, const uint32_t quirks){
+    bool carry; // Save the carry flag/VF value for some instructions
+
+    // Get next opcode from ram. PC is kept at most RAM_MASK, so the fetch needs
+    // no mask; an odd PC of 0xFFF reads its second byte from the guard area
+    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
+    chip8->PC = (chip8->PC + 2) & RAM_MASK; // Pre-increment program counter for next opcode
+
+    // Fill out instruction format
+    decode_instruction(&chip8->inst, chip8->inst.opcode);
+
+#ifdef DEBUG
+    print_debug_info(chip8);
+#endif
+
+    // Emulate opcode
+    switch((chip8->inst.opcode >> 12) & 0x0F){
+        case 0x00:
+            if(chip8->inst.NN == 0xE0){
+                // 0x00E0: Clear screen
+                memset(&chip8->display[0], 0, sizeof chip8->display);
+                chip8->draw = true; // Will update screen on next 60 hz tick
+
+            }
+            else if(chip8->inst.NN == 0xEE){
+                // 0x00EE: Return from subroutine
+                // set progrma address to last address from subroutine stack ("pop" it off the stack)
+                // so that next opcode will be gotten from address.
+                chip8->PC = stack_pop(chip8);
+            }
+            else {
+                // Unimplemented invalid code, may be 0xNNN fro calling machine code routine for RCA1802
+            }
+            break;
+        case 0x01:
+            // 0x1NNN jumps to address NNN
+            chip8->PC = chip8->inst.NNN; // Set program counter so that next opcode is from NNN
+            break;
+        case 0x02:
+            // 0x2NNN: Call subroutine at NNN
+            // Store current address to return to on subroutine stack ("push" iton the stack)
+            // and set program counter to subroutine address so that the next opcode
+            // is gotten from there.
+
+            stack_push(chip8, chip8->PC);
+            chip8->PC = chip8->inst.NNN;
+            break;
+        case 0x03:
+            // 0x3XNN: Check if VX == NN, if so, skip the next instruction
+            if(chip8->V[chip8->inst.X] == chip8->inst.NN){
+                skip_instruction(chip8);
+            } 
+            break;
+        case 0x04:
+            // 0x4XNN: Check if VX != NN, if so, skip the next instruction
+            if(chip8->V[chip8->inst.X] != chip8->inst.NN){
+                skip_instruction(chip8);
+            } 
+            break;
+        case 0x05:
+            if(chip8-> inst.N != 0) break; // Wrong opcode
+
+            // 0x5XY0: Check if VX == VY, if so, skip the next instruction
+            if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]){
+                skip_instruction(chip8);
+            } 
+            break;
+        case 0x06:
+            // 0x6XNN: Set register VX to NN
+            chip8->V[chip8->inst.X] = chip8->inst.NN;
+            break;
+        case 0x07:
+            // 0x6XNN: Set register VX += NN
+            chip8->V[chip8->inst.X] += chip8->inst.NN;
+            break;
+        case 0x08:
+            switch(chip8->inst.N){
+                case 0:
+                    // 0x8XY0: Set register VX = VY
+                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+                    break;
+                case 1:
+                    // 0x8XY1: Set register VX |= VY
+                    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+                    if(quirks & QUIRK_VF_RESET)
+                        chip8->V[0xF] = 0; // reset VF to 0
+                    break;
+                case 2:
+                    // 0x8XY2: Set register VX &= VY
+                    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+                    if(quirks & QUIRK_VF_RESET)
+                        chip8->V[0xF] = 0; // reset VF to 0
+                    break;
+                case 3:
+                    // 0x8XY3: Set register VX ^= VY
+                    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+                    if(quirks & QUIRK_VF_RESET)
+                        chip8->V[0xF] = 0; // reset VF to 0
+                    break;
+                case 4:
+                    // 0x8XY4: Set register VX += VY
+                    //if ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255){
+                    //    chip8->V[0xF] = 1;
+                    //}
+                    //chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+
+                    carry = ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
+                    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+                    chip8->V[0xF] = carry;
+
+                    break;
+                case 5:
+                    // 0x8XY5: Set register VX -= VY
+                    //if (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]){
+                    //    chip8->V[0xF] = 1;
+                    //}
+
+                    carry = (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]);
+                    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+
+                    chip8->V[0xF] = carry;
+                    break;
+                case 6:
+                    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
+                    
+                    if(quirks & QUIRK_SHIFT_VY){
+                        carry = chip8->V[chip8->inst.Y] & 1;
+                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
+                    }
+                    else{
+                        carry = chip8->V[chip8->inst.X] & 1;
+                        chip8->V[chip8->inst.X] >>= 1;
+                    }
+
+                    chip8->V[0xF] = carry;
                     break;
                 case 7:
                     // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive)
-                    printf("Set register V%X = V%X (0x%02X) - V%X (0X%02X), VF = 1 if no borrow; Result: 0X%02X, VF = %X\n", 
-                        chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X],
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
-                        (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
+                    //if (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]){
+                    //    chip8->V[0xF] = 1;
+                    //}
+
+                    carry = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
+                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+                    chip8->V[0xF] = carry;
+                    break;
+                case 0xE:
+                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+                    if(quirks & QUIRK_SHIFT_VY){
+                        carry = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
+                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
+                    }
+                    else{
+                        carry = (chip8->V[chip8->inst.X] & 0x80) >> 7;
+                        chip8->V[chip8->inst.X] <<= 1;
+                    }
+
+                    chip8->V[0xF] = carry;
+                    break;
+                default:
+                    // Wrong/unimplemented opcode
+                    break;
+            }
+            break;
+        case 0x09:
+            // 0x9XY0: Skip next instruction if VX != VY
+            if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]){
+                skip_instruction(chip8);
+            }
+            break;
+        case 0x0A:
+            // 0xANNN: Set I to NNN
+            chip8->I = chip8->inst.NNN;
+            break;
+        case 0x0B:
+            // 0xBNNN: Jump to address v0 + NNN
+            chip8->violations.ram += chip8->V[0] + chip8->inst.NNN > RAM_MASK;
+            chip8->PC = (chip8->V[0] + chip8->inst.NNN) & RAM_MASK;
+
+            break;
+        case 0x0C:
+            // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
+            chip8->V[chip8->inst.X] = chip8_rand(chip8) & chip8->inst.NN;
+
+            break;
+        case 0x0D:
+            // 0xDXYN: Draw N height sprite coors X, Y; Read from memory location I;
+            // Screen pixels are XOR'd with sprite bits,
+            // VF (Carry flag) is set if any screen pixels are set off; this is usefull
+            // for collision detection or other reasons.
+
+            draw_sprite(chip8, config, quirks);
+            break;
+        case 0x0E:
+            if(chip8->inst.NN == 0x9E){
+                // 0xEX9E: Skip next instruction if key in VX is pressed
+                if(key_down(chip8, chip8->V[chip8->inst.X]) == true)
+                    skip_instruction(chip8);
+            }
+            else if(chip8->inst.NN == 0xA1){
+                if(!key_down(chip8, chip8->V[chip8->inst.X]))
+                    skip_instruction(chip8);
+            }
+            break;
+        case 0x0F:
+            switch(chip8->inst.NN){
+                case 0x0A:
+                    // 0xFX0A: VX = get_key(): Await until a keypress, an store in VX
+                    for(uint8_t i = 0; chip8->wait_key == 0xFF && i < sizeof chip8->keypad; i++){
+                        if(chip8->keypad[i]){
+                            chip8->wait_key = i;
+                            //chip8->V[chip8->inst.X] = i; // i = key (offset into keypad array)
+                            break;
+                        }
+                    }
+
+                    // Keep gettinh the current opcode nad running this instruction
+                    if(chip8->wait_key == 0xFF){
+                        chip8->PC = (chip8->PC - 2) & RAM_MASK;
+                    }
+                    else{
+                        if(chip8->keypad[chip8->wait_key]){
+                            chip8->PC = (chip8->PC - 2) & RAM_MASK;
+                        }
+                        else{
+                            // A key has been pressed, also wait until it is released
+                            chip8->V[chip8->inst.X] = chip8->wait_key;
+                            chip8->wait_key = 0xFF;
+                        }
+                    }
+
+                    break;
+
+                case 0x1E:
+                    // 0xFX1E: I += VX; Add VX to register I. For non-Aniga CHIP8, does not affect VF
+                    chip8->I += chip8->V[chip8->inst.X];
+                    break;
+                case 0x07:
+                    // 0xFX07: Set VX to delay timer value
+                    chip8->V[chip8->inst.X] = chip8->delay_timer;
+                    break;
+                case 0x15:
+                    // 0xFX15: Set delay timer to VX
+                    chip8->delay_timer = chip8->V[chip8->inst.X];
+                    break;
+                case 0x18:
+                    // 0xFX18: Set sound timer to VX
+                    chip8->sound_timer = chip8->V[chip8->inst.X];
+                    break;
+                case 0x29:
+                    // 0xFX29: Set register I to location of sprite for digit VX
+                    chip8->I = chip8->V[chip8->inst.X] * 5; // Each sprite is 5 bytes long
+                    break;
+                case 0x33:
+                    // 0xFX33: Store BCD representation of VX in memory locations I, I+1, I+2
+                    uint8_t bcd = chip8->V[chip8->inst.X];
+                    uint8_t *digits = ram_span(chip8, chip8->I, 3);
+                    digits[2] = bcd % 10;
+                    bcd /= 10;
+                    digits[1] = bcd % 10;
+                    bcd /= 10;
+                    digits[0] = bcd;
+                    fuse_invalidate(chip8, chip8->I, 3);
                     break;
-                case 0xE:
-                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-                    printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result 0X%02X\n", 
-                        chip8->inst.X, chip8->V[chip8->inst.X],
-                        chip8->V[chip8->inst.X] & (0x08) >> 7,
-                        chip8->V[chip8->inst.X] << 1);
+                case 0x55:
+                    // 0xFX55: Store V0 to VX in memory starting at I
+                    // NOTE: Could make this a config flag to use SCHHIP or CHIP8 behavior for I
+                    uint8_t *store = ram_span(chip8, chip8->I, chip8->inst.X + 1);
+                    for(uint8_t i = 0; i <= chip8->inst.X; i++){
+                        store[i] = chip8->V[i];
+                    }
+                    fuse_invalidate(chip8, chip8->I, chip8->inst.X + 1);
+                    if(quirks & QUIRK_MEMORY_INC_I){
+                        chip8->I += chip8->inst.X + 1; // I left past the last register stored
+                    }
+                    break;
+                case 0x65:
+                    // 0xFX65: Fill V0 to VX with values from memory starting at I
+                    // NOTE: Could make this a config flag to use SCHHIP or CHIP8 behavior for I
+                    load_registers(chip8, quirks);
                     break;
                 default:
                     // Wrong/unimplemented opcode
                     break;
             }
-            break;
-        case 0x09:
-            // 0x9XY0: Skip next instruction if VX != VY
-            printf("Set register V%X (0x%02X) != V%X (0X%02X), skip next instruction if true\n", 
-                chip8->inst.X, chip8->V[chip8->inst.X],
-                chip8->inst.Y, chip8->V[chip8->inst.Y]);
-            break;
-        case 0x0B:
-            // 0xBNNN: Jump to address v0 + NNN
-            printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
-                chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
+            break;
+        default:
+            break;
+    }
+}
+
+// Instantiate one interpreter per quirk combination. With QUIRK_DISPLAY_WAIT
+// the rest of the count is given up after a draw, the frame is over.
+#define DEFINE_INTERPRETER(quirks) \
+    uint32_t emulate_instructions_q##quirks(chip8_t *chip8, const config_t *config, const uint32_t count){ \
+        for(uint32_t i = 0; i < count; i++){ \
+            emulate_instruction(chip8, config, quirks); \
+            FUZZ_TRACE(chip8); \
+            if(((quirks) & QUIRK_DISPLAY_WAIT) && chip8->vblank_wait) return i + 1; \
+        } \
+        return count; \
+    }
+
+DEFINE_INTERPRETER(0)
+DEFINE_INTERPRETER(1)
+DEFINE_INTERPRETER(2)
+DEFINE_INTERPRETER(3)
+DEFINE_INTERPRETER(4)
+DEFINE_INTERPRETER(5)
+DEFINE_INTERPRETER(6)
+DEFINE_INTERPRETER(7)
+DEFINE_INTERPRETER(8)
+DEFINE_INTERPRETER(9)
+DEFINE_INTERPRETER(10)
+DEFINE_INTERPRETER(11)
+DEFINE_INTERPRETER(12)
+DEFINE_INTERPRETER(13)
+DEFINE_INTERPRETER(14)
+DEFINE_INTERPRETER(15)
+
+static inline ALWAYS_INLINE uint16_t fetch_opcode(const chip8_t *chip8, const uint16_t address){
+    return (chip8->ram[address] << 8) | chip8->ram[address + 1];
+}
+
+// Run the fused operation at PC as its instructions would run one at a time,
+// but at most remaining of them. Leaves chip8->inst and PC as the last of
+// them would, and returns how many ran.
+static inline ALWAYS_INLINE uint32_t emulate_fused(chip8_t *chip8, const config_t *config, const uint32_t quirks,
+                                                   const uint8_t fused, const uint32_t remaining){
+    const uint16_t pc = chip8->PC; // Fused operations never wrap, pc + FUSE_WINDOW <= RAM_MASK + 1
+    const uint16_t first = fetch_opcode(chip8, pc);
+    const uint8_t X = (first >> 8) & 0x0F;
+
+    if((fused & FUSE_KIND_MASK) == FUSE_SET_CHAIN){
+        // 6XNN/7XNN differ in bit 12 only
+        const uint32_t count = (fused >> 4) < remaining ? (fused >> 4) : remaining;
+        uint16_t opcode = first;
+        for(uint32_t i = 0; i < count; i++){
+            opcode = fetch_opcode(chip8, pc + 2 * i);
+            const uint8_t x = (opcode >> 8) & 0x0F;
+            chip8->V[x] = ((opcode & 0x1000) ? chip8->V[x] : 0) + (opcode & 0xFF);
+        }
+        decode_instruction(&chip8->inst, opcode);
+        chip8->PC = (pc + 2 * count) & RAM_MASK;
+        return count;
+    }
+
+    if(remaining < 2){
+        emulate_instruction(chip8, config, quirks);
+        return 1;
+    }
+
+    const uint16_t second = fetch_opcode(chip8, pc + 2);
+    switch(fused & FUSE_KIND_MASK){
+        case FUSE_LOAD_DRAW:
+            chip8->I = first & 0x0FFF;
+            decode_instruction(&chip8->inst, second);
+            chip8->PC = pc + 4;
+            draw_sprite(chip8, config, quirks);
+            return 2;
+
+        case FUSE_SKIP_JUMP:
+            // 3XNN skips the jump when VX == NN, 4XNN when VX != NN
+            if((chip8->V[X] == (first & 0xFF)) != ((first >> 12) == 0x4)){
+                decode_instruction(&chip8->inst, first);
+                chip8->PC = pc + 4;
+                return 1;
+            }
+            decode_instruction(&chip8->inst, second);
+            chip8->PC = second & 0x0FFF;
+            return 2;
+
+        case FUSE_INDEX_LOAD:
+            chip8->I += chip8->V[X];
+            decode_instruction(&chip8->inst, second);
+            chip8->PC = pc + 4;
+            load_registers(chip8, quirks);
+            return 2;
+
+        default: // FUSE_DELAY_POLL
+            chip8->V[X] = chip8->delay_timer;
+            if(chip8->delay_timer == 0){
+                // 3X00 skips the jump back, the loop is done
+                decode_instruction(&chip8->inst, second);
+                chip8->PC = pc + 6;
+                return 2;
+            }
+
+            // The timer only changes between frames, so the loop spins for all
+            // of remaining. Stop where the last of those instructions leaves it.
+            switch(remaining % 3){
+                case 0: decode_instruction(&chip8->inst, fetch_opcode(chip8, pc + 4)); chip8->PC = pc; break;
+                case 1: decode_instruction(&chip8->inst, first); chip8->PC = pc + 2; break;
+                default: decode_instruction(&chip8->inst, second); chip8->PC = pc + 4; break;
+            }
+            return remaining;
+    }
+}
+
+// Fused instances of the same per-quirk interpreter, the default
+#define DEFINE_FUSED_INTERPRETER(quirks) \
+    uint32_t emulate_fused_q##quirks(chip8_t *chip8, const config_t *config, const uint32_t count){ \
+        uint32_t i = 0; \
+        while(i < count){ \
+            const uint8_t fused = chip8->fused[chip8->PC]; \
+            if(fused && !fuse_stale(chip8, chip8->PC)){ \
+                i += emulate_fused(chip8, config, quirks, fused, count - i); \
+            } \
+            else{ \
+                emulate_instruction(chip8, config, quirks); \
+                i++; \
+            } \
+            if(((quirks) & QUIRK_DISPLAY_WAIT) && chip8->vblank_wait) return i; \
+        } \
+        return i; \
+    }
+
+DEFINE_FUSED_INTERPRETER(0)
+DEFINE_FUSED_INTERPRETER(1)
+DEFINE_FUSED_INTERPRETER(2)
+DEFINE_FUSED_INTERPRETER(3)
+DEFINE_FUSED_INTERPRETER(4)
+DEFINE_FUSED_INTERPRETER(5)
+DEFINE_FUSED_INTERPRETER(6)
+DEFINE_FUSED_INTERPRETER(7)
+DEFINE_FUSED_INTERPRETER(8)
+DEFINE_FUSED_INTERPRETER(9)
+DEFINE_FUSED_INTERPRETER(10)
+DEFINE_FUSED_INTERPRETER(11)
+DEFINE_FUSED_INTERPRETER(12)
+DEFINE_FUSED_INTERPRETER(13)
+DEFINE_FUSED_INTERPRETER(14)
+DEFINE_FUSED_INTERPRETER(15)
+
+// Pick the interpreter instance for config->quirks, done once at startup.
+// DEBUG builds trace every instruction, so they never fuse.
+interpreter_t select_interpreter(const config_t *config){
+    static const interpreter_t interpreters[1 << QUIRK_COUNT] = {
+        emulate_instructions_q0, emulate_instructions_q1, emulate_instructions_q2, emulate_instructions_q3,
+        emulate_instructions_q4, emulate_instructions_q5, emulate_instructions_q6, emulate_instructions_q7,
+        emulate_instructions_q8, emulate_instructions_q9, emulate_instructions_q10, emulate_instructions_q11,
+        emulate_instructions_q12, emulate_instructions_q13, emulate_instructions_q14, emulate_instructions_q15,
+    };
+    static const interpreter_t fused_interpreters[1 << QUIRK_COUNT] = {
+        emulate_fused_q0, emulate_fused_q1, emulate_fused_q2, emulate_fused_q3,
+        emulate_fused_q4, emulate_fused_q5, emulate_fused_q6, emulate_fused_q7,
+        emulate_fused_q8, emulate_fused_q9, emulate_fused_q10, emulate_fused_q11,
+        emulate_fused_q12, emulate_fused_q13, emulate_fused_q14, emulate_fused_q15,
+    };
+#ifdef DEBUG
+    const bool fusion = false;
+#else
+    const bool fusion = config->fusion;
+#endif
+    return (fusion ? fused_interpreters : interpreters)[config->quirks & ((1 << QUIRK_COUNT) - 1)];
+}
+
+// Approximate COSMAC VIP interpreter cost of the instruction just run, in
+// machine cycles: fetch and decode, then the opcode's own routine
+static inline ALWAYS_INLINE uint32_t vip_cycles(const chip8_t *chip8){
+    uint32_t cycles = 40; // Fetch, decode and dispatch through the opcode table
+    switch((chip8->inst.opcode >> 12) & 0x0F){
+        case 0x00:
+            if(chip8->inst.NN == 0xE0) cycles += 1024; // 256 bytes of display RAM cleared, 4 cycles each
+            else cycles += 20;
+            break;
+        case 0x01: cycles += 12; break;
+        case 0x02: cycles += 26; break;
+        case 0x03: case 0x04: cycles += 12; break;
+        case 0x05: case 0x09: cycles += 18; break;
+        case 0x06: cycles += 6; break;
+        case 0x07: cycles += 10; break;
+        case 0x08: cycles += 44; break; // Every 8XYn builds and calls a small 1802 routine
+        case 0x0A: cycles += 12; break;
+        case 0x0B: cycles += 22; break;
+        case 0x0C: cycles += 36; break;
+        case 0x0D: cycles += 60 + 40 * chip8->inst.N; break; // Each row is shifted into place and XORed
+        case 0x0E: cycles += 18; break;
+        default:
+            switch(chip8->inst.NN){
+                case 0x1E: cycles += 16; break;
+                case 0x29: cycles += 18; break;
+                case 0x33: cycles += 400; break; // BCD by repeated subtraction
+                case 0x55: case 0x65: cycles += 16 + 14 * (chip8->inst.X + 1); break;
+                default: cycles += 10; break;
+            }
+    }
+    return cycles;
+}
+
+// Cycle of the first vblank at or after cycles, a clock exactly on one has reached it
+static inline uint64_t vip_vblank(const uint64_t cycles){
+    return (cycles + VIP_CYCLES_PER_FRAME - 1) / VIP_CYCLES_PER_FRAME * VIP_CYCLES_PER_FRAME;
+}
+
+// Cycle of the vblank ending the frame that starts at cycles. A frame starts
+// after its previous vblank, so one starting at cycle 0 runs a whole frame.
+static inline uint64_t vip_frame_end(const uint64_t cycles){
+    return vip_vblank(cycles + 1);
+}
+
+// Charge the instruction just run to the cycle clock, a display wait idles until vblank
+static inline ALWAYS_INLINE void vip_advance(chip8_t *chip8, const uint32_t quirks){
+    chip8->cycles += vip_cycles(chip8);
+    if((quirks & QUIRK_DISPLAY_WAIT) && chip8->vblank_wait) chip8->cycles = vip_vblank(chip8->cycles);
+}
+
+// Cycle budget instances of the same per-quirk interpreter, for vip_timing
+#define DEFINE_CYCLE_INTERPRETER(quirks) \
+    uint32_t emulate_cycles_q##quirks(chip8_t *chip8, const config_t *config, const uint64_t until){ \
+        uint32_t count = 0; \
+        while(chip8->cycles < until){ \
+            emulate_instruction(chip8, config, quirks); \
+            vip_advance(chip8, quirks); \
+            count++; \
+        } \
+        return count; \
+    }
+
+DEFINE_CYCLE_INTERPRETER(0)
+DEFINE_CYCLE_INTERPRETER(1)
+DEFINE_CYCLE_INTERPRETER(2)
+DEFINE_CYCLE_INTERPRETER(3)
+DEFINE_CYCLE_INTERPRETER(4)
+DEFINE_CYCLE_INTERPRETER(5)
+DEFINE_CYCLE_INTERPRETER(6)
+DEFINE_CYCLE_INTERPRETER(7)
+DEFINE_CYCLE_INTERPRETER(8)
+DEFINE_CYCLE_INTERPRETER(9)
+DEFINE_CYCLE_INTERPRETER(10)
+DEFINE_CYCLE_INTERPRETER(11)
+DEFINE_CYCLE_INTERPRETER(12)
+DEFINE_CYCLE_INTERPRETER(13)
+DEFINE_CYCLE_INTERPRETER(14)
+DEFINE_CYCLE_INTERPRETER(15)
+
+cycle_interpreter_t select_cycle_interpreter(const config_t *config){
+    static const cycle_interpreter_t interpreters[1 << QUIRK_COUNT] = {
+        emulate_cycles_q0, emulate_cycles_q1, emulate_cycles_q2, emulate_cycles_q3,
+        emulate_cycles_q4, emulate_cycles_q5, emulate_cycles_q6, emulate_cycles_q7,
+        emulate_cycles_q8, emulate_cycles_q9, emulate_cycles_q10, emulate_cycles_q11,
+        emulate_cycles_q12, emulate_cycles_q13, emulate_cycles_q14, emulate_cycles_q15,
+    };
+    return interpreters[config->quirks & ((1 << QUIRK_COUNT) - 1)];
+}
+
+// Debugger
+
+static inline bool bitmap_get(const uint8_t *bitmap, const uint32_t bit){
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+// Set or clear a bit, keeping count of the set bits
+static inline void bitmap_set(uint8_t *bitmap, const uint32_t bit, const bool on, uint32_t *count){
+    if(bitmap_get(bitmap, bit) == on) return;
+    bitmap[bit / 8] ^= 1 << (bit % 8);
+    *count += on ? 1 : -1;
+}
+
+// Recompute whether the main loop needs the checked interpreter
+void debug_update_armed(debugger_t *debugger){
+    debugger->armed = debugger->num_breakpoints || debugger->num_watches || debugger->num_conds || debugger->steps;
+}
+
+void debug_set_breakpoint(debugger_t *debugger, const uint16_t address, const bool on){
+    bitmap_set(debugger->breakpoints, address & RAM_MASK, on, &debugger->num_breakpoints);
+    debug_update_armed(debugger);
+}
+
+// Set or clear read and/or write watches on length bytes from address
+void debug_set_watch(debugger_t *debugger, const uint16_t address, const uint32_t length,
+                     const bool read, const bool write, const bool on){
+    for(uint32_t i = 0; i < length; i++){
+        const uint32_t bit = (address + i) & RAM_MASK;
+        if(read) bitmap_set(debugger->watch_read, bit, on, &debugger->num_watches);
+        if(write) bitmap_set(debugger->watch_write, bit, on, &debugger->num_watches);
+    }
+    debug_update_armed(debugger);
+}
+
+void debug_clear_all(debugger_t *debugger){
+    memset(debugger->breakpoints, 0, sizeof debugger->breakpoints);
+    memset(debugger->watch_read, 0, sizeof debugger->watch_read);
+    memset(debugger->watch_write, 0, sizeof debugger->watch_write);
+    debugger->num_breakpoints = debugger->num_watches = debugger->num_conds = 0;
+    debugger->steps = 0;
+    debug_update_armed(debugger);
+}
+
+void debug_stop(debugger_t *debugger, const stop_reason_t reason){
+    debugger->stopped = true;
+    debugger->reported = false;
+    debugger->reason = reason;
+    debugger->steps = 0;
+    debug_update_armed(debugger);
+}
+
+// Continue, or single step steps instructions when steps > 0
+void debug_resume(debugger_t *debugger, const uint32_t steps){
+    debugger->stopped = false;
+    debugger->resuming = true;
+    debugger->reason = STOP_NONE;
+    debugger->steps = steps;
+    debug_update_armed(debugger);
+}
+
+uint16_t debug_get_register(const chip8_t *chip8, const uint32_t reg){
+    switch(reg){
+        case REG_I: return chip8->I;
+        case REG_PC: return chip8->PC;
+        case REG_SP: return chip8->sp;
+        case REG_DT: return chip8->delay_timer;
+        case REG_ST: return chip8->sound_timer;
+        default: return chip8->V[reg & 0xF];
+    }
+}
+
+void debug_set_register(debugger_t *debugger, chip8_t *chip8, const uint32_t reg, const uint16_t value){
+    debugger->modified = true;
+    switch(reg){
+        case REG_I: chip8->I = value; break;
+        case REG_PC: chip8->PC = value & RAM_MASK; break; // The fetch relies on PC <= RAM_MASK
+        case REG_SP: chip8->sp = value & SP_MASK; break;
+        case REG_DT: chip8->delay_timer = value; break;
+        case REG_ST: chip8->sound_timer = value; break;
+        default: chip8->V[reg & 0xF] = value; break;
+    }
+}
+
+bool debug_eval_cond(const debug_cond_t *cond, const chip8_t *chip8){
+    const uint16_t value = debug_get_register(chip8, cond->reg);
+    switch(cond->op){
+        case COND_EQ: return value == cond->value;
+        case COND_NE: return value != cond->value;
+        case COND_LT: return value < cond->value;
+        case COND_GT: return value > cond->value;
+        case COND_LE: return value <= cond->value;
+        case COND_GE: return value >= cond->value;
+    }
+    return false;
+}
+
+// Data bytes the next instruction reads or writes, length 0 if none
+void debug_data_access(const chip8_t *chip8, uint16_t *address, uint32_t *length, bool *write){
+    const uint16_t opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
+    const uint8_t X = (opcode >> 8) & 0x0F;
+
+    *address = chip8->I;
+    *length = 0;
+    *write = false;
+    if((opcode >> 12) == 0xD){
+        *length = opcode & 0xF; // DXYN reads the sprite
+    }
+    else if((opcode >> 12) == 0xF){
+        switch(opcode & 0xFF){
+            case 0x33: *length = 3; *write = true; break; // FX33 writes BCD digits
+            case 0x55: *length = X + 1; *write = true; break; // FX55 stores registers
+            case 0x65: *length = X + 1; break; // FX65 loads registers
+        }
+    }
+}
+
+// Before an instruction: stop on a PC breakpoint, note if it will touch a watched byte
+static inline bool debug_before(debugger_t *debugger, const chip8_t *chip8){
+    if(!debugger->resuming && bitmap_get(debugger->breakpoints, chip8->PC)){
+        debug_stop(debugger, STOP_BREAKPOINT);
+        return true;
+    }
+    debugger->resuming = false;
+
+    if(debugger->num_watches){
+        uint16_t address;
+        uint32_t length;
+        bool write;
+        debug_data_access(chip8, &address, &length, &write);
+        for(uint32_t i = 0; i < length; i++){
+            const uint16_t byte = (address + i) & RAM_MASK;
+            if(bitmap_get(write ? debugger->watch_write : debugger->watch_read, byte)){
+                debugger->pending = write ? STOP_WATCH_WRITE : STOP_WATCH_READ;
+                debugger->stop_address = byte;
+                break;
+            }
+        }
+    }
+    return false;
+}
+
+// After an instruction: stop on a watch hit, a condition becoming true or the last step
+static inline bool debug_after(debugger_t *debugger, const chip8_t *chip8){
+    stop_reason_t reason = debugger->pending;
+    debugger->pending = STOP_NONE;
+
+    for(uint32_t i = 0; i < debugger->num_conds; i++){
+        debug_cond_t *cond = &debugger->conds[i];
+        const bool now = debug_eval_cond(cond, chip8);
+        if(now && !cond->was_true && reason == STOP_NONE) reason = STOP_CONDITION;
+        cond->was_true = now;
+    }
+
+    if(debugger->steps && --debugger->steps == 0 && reason == STOP_NONE) reason = STOP_STEP;
+
+    if(reason == STOP_NONE) return false;
+    debug_stop(debugger, reason);
+    return true;
+}
+
+// Checked instances of the same per-quirk interpreter, only run while the debugger is armed
+#define DEFINE_CHECKED_INTERPRETER(quirks) \
+    uint32_t emulate_instructions_checked_q##quirks(chip8_t *chip8, const config_t *config, debugger_t *debugger, \
+                                                    const uint32_t count){ \
+        for(uint32_t i = 0; i < count; i++){ \
+            if(debug_before(debugger, chip8)) return i; \
+            emulate_instruction(chip8, config, quirks); \
+            if(config->vip_timing) vip_advance(chip8, quirks); \
+            if(debug_after(debugger, chip8)) return i + 1; \
+            if(((quirks) & QUIRK_DISPLAY_WAIT) && chip8->vblank_wait) return i + 1; \
+        } \
+        return count; \
+    }
+
+DEFINE_CHECKED_INTERPRETER(0)
+DEFINE_CHECKED_INTERPRETER(1)
+DEFINE_CHECKED_INTERPRETER(2)
+DEFINE_CHECKED_INTERPRETER(3)
+DEFINE_CHECKED_INTERPRETER(4)
+DEFINE_CHECKED_INTERPRETER(5)
+DEFINE_CHECKED_INTERPRETER(6)
+DEFINE_CHECKED_INTERPRETER(7)
+DEFINE_CHECKED_INTERPRETER(8)
+DEFINE_CHECKED_INTERPRETER(9)
+DEFINE_CHECKED_INTERPRETER(10)
+DEFINE_CHECKED_INTERPRETER(11)
+DEFINE_CHECKED_INTERPRETER(12)
+DEFINE_CHECKED_INTERPRETER(13)
+DEFINE_CHECKED_INTERPRETER(14)
+DEFINE_CHECKED_INTERPRETER(15)
+
+checked_interpreter_t select_checked_interpreter(const config_t *config){
+    static const checked_interpreter_t interpreters[1 << QUIRK_COUNT] = {
+        emulate_instructions_checked_q0, emulate_instructions_checked_q1,
+        emulate_instructions_checked_q2, emulate_instructions_checked_q3,
+        emulate_instructions_checked_q4, emulate_instructions_checked_q5,
+        emulate_instructions_checked_q6, emulate_instructions_checked_q7,
+        emulate_instructions_checked_q8, emulate_instructions_checked_q9,
+        emulate_instructions_checked_q10, emulate_instructions_checked_q11,
+        emulate_instructions_checked_q12, emulate_instructions_checked_q13,
+        emulate_instructions_checked_q14, emulate_instructions_checked_q15,
+    };
+    return interpreters[config->quirks & ((1 << QUIRK_COUNT) - 1)];
+}
+
+// Append printf style text to a bounded buffer
+void debug_printf(char *out, const size_t size, const char *fmt, ...){
+    const size_t used = strlen(out);
+    if(used + 1 >= size) return;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(out + used, size - used, fmt, args);
+    va_end(args);
+}
+
+void debug_print_stop(const debugger_t *debugger, const chip8_t *chip8, char *out, const size_t size){
+    static const char *reasons[] = {
+        [STOP_NONE] = "running",
+        [STOP_BREAKPOINT] = "breakpoint",
+        [STOP_WATCH_READ] = "read watchpoint",
+        [STOP_WATCH_WRITE] = "write watchpoint",
+        [STOP_CONDITION] = "register condition",
+        [STOP_STEP] = "step",
+        [STOP_INTERRUPT] = "interrupted",
+    };
+
+    debug_printf(out, size, "Stopped at %03X (%s", chip8->PC, reasons[debugger->reason]);
+    if(debugger->reason == STOP_WATCH_READ || debugger->reason == STOP_WATCH_WRITE){
+        debug_printf(out, size, " %03X", debugger->stop_address);
+    }
+    char text[32];
+    disassemble((chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1], text, sizeof text);
+    debug_printf(out, size, "): %02X%02X  %s\n", chip8->ram[chip8->PC], chip8->ram[chip8->PC + 1], text);
+}
+
+void debug_print_registers(const chip8_t *chip8, char *out, const size_t size){
+    for(uint32_t i = 0; i < 16; i++){
+        debug_printf(out, size, "V%X=%02X%s", i, chip8->V[i], i == 7 || i == 15 ? "\n" : " ");
+    }
+    debug_printf(out, size, "I=%03X PC=%03X SP=%u DT=%02X ST=%02X\n",
+                 chip8->I, chip8->PC, chip8->sp, chip8->delay_timer, chip8->sound_timer);
+}
+
+// Parse a register name for register conditions: v0-vf, i, pc, sp, dt, st
+bool debug_parse_register(const char *name, uint8_t *reg){
+    static const char *names[REG_COUNT] = {[REG_I] = "i", [REG_PC] = "pc", [REG_SP] = "sp", [REG_DT] = "dt", [REG_ST] = "st"};
+
+    char lower[4] = "";
+    if(strlen(name) >= sizeof lower) return false;
+    for(uint32_t i = 0; name[i]; i++) lower[i] = tolower((unsigned char)name[i]);
+
+    if(lower[0] == 'v' && isxdigit((unsigned char)lower[1]) && !lower[2]){
+        *reg = (uint8_t)strtoul(&lower[1], NULL, 16);
+        return true;
+    }
+    for(uint32_t r = REG_I; r < REG_COUNT; r++){
+        if(strcmp(lower, names[r]) == 0){
+            *reg = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run one monitor command, also used for GDB "monitor" commands. Numbers are
+// hex. Output is appended to out. Returns false for an unknown command.
+bool debug_command(debugger_t *debugger, chip8_t *chip8, const char *line, char *out, const size_t size){
+    static const char *ops[] = {[COND_EQ] = "==", [COND_NE] = "!=", [COND_LT] = "<",
+                                [COND_GT] = ">", [COND_LE] = "<=", [COND_GE] = ">="};
+    char cmd[16] = "", arg1[16] = "", arg2[16] = "", arg3[16] = "";
+    const int args = sscanf(line, "%15s %15s %15s %15s", cmd, arg1, arg2, arg3);
+    if(args < 1) return true; // Empty line
+
+    const uint16_t address = (uint16_t)strtoul(arg1, NULL, 16);
+    const uint32_t length = args >= 3 ? (uint32_t)strtoul(arg2, NULL, 16) : 1;
+
+    if(strcmp(cmd, "b") == 0 && args >= 2){
+        debug_set_breakpoint(debugger, address, true);
+    }
+    else if(strcmp(cmd, "bd") == 0 && args >= 2){
+        debug_set_breakpoint(debugger, address, false);
+    }
+    else if((strcmp(cmd, "w") == 0 || strcmp(cmd, "r") == 0 || strcmp(cmd, "a") == 0) && args >= 2){
+        debug_set_watch(debugger, address, length, cmd[0] != 'w', cmd[0] != 'r', true);
+    }
+    else if(strcmp(cmd, "wd") == 0 && args >= 2){
+        debug_set_watch(debugger, address, length, true, true, false);
+    }
+    else if(strcmp(cmd, "cond") == 0 && args >= 2 && strcmp(arg1, "clear") == 0){
+        debugger->num_conds = 0;
+        debug_update_armed(debugger);
+    }
+    else if(strcmp(cmd, "cond") == 0 && args == 4){
+        debug_cond_t cond = {.value = (uint16_t)strtoul(arg3, NULL, 16)};
+        uint32_t op = 0;
+        while(op < sizeof ops / sizeof ops[0] && strcmp(arg2, ops[op]) != 0) op++;
+
+        if(!debug_parse_register(arg1, &cond.reg) || op == sizeof ops / sizeof ops[0]){
+            debug_printf(out, size, "Usage: cond <v0-vf|i|pc|sp|dt|st> <==|!=|<|>|<=|>=> <value>\n");
+        }
+        else if(debugger->num_conds == DEBUG_MAX_CONDS){
+            debug_printf(out, size, "Only %u conditions\n", DEBUG_MAX_CONDS);
+        }
+        else{
+            cond.op = op;
+            cond.was_true = debug_eval_cond(&cond, chip8);
+            debugger->conds[debugger->num_conds++] = cond;
+            debug_update_armed(debugger);
+        }
+    }
+    else if(strcmp(cmd, "s") == 0){
+        if(debugger->stopped) debug_resume(debugger, args >= 2 ? (uint32_t)strtoul(arg1, NULL, 16) : 1);
+    }
+    else if(strcmp(cmd, "c") == 0){
+        if(debugger->stopped) debug_resume(debugger, 0);
+    }
+    else if(strcmp(cmd, "stop") == 0){
+        if(!debugger->stopped) debug_stop(debugger, STOP_INTERRUPT);
+    }
+    else if(strcmp(cmd, "regs") == 0){
+        debug_print_registers(chip8, out, size);
+    }
+    else if(strcmp(cmd, "set") == 0 && args == 3){
+        uint8_t reg;
+        if(debug_parse_register(arg1, &reg)) debug_set_register(debugger, chip8, reg, (uint16_t)strtoul(arg2, NULL, 16));
+        else debug_printf(out, size, "Unknown register %s\n", arg1);
+    }
+    else if(strcmp(cmd, "x") == 0 && args >= 2){
+        const uint32_t bytes = args >= 3 ? length : 16;
+        for(uint32_t i = 0; i < bytes; i++){
+            if(i % 16 == 0) debug_printf(out, size, "%s%03X:", i ? "\n" : "", (address + i) & RAM_MASK);
+            debug_printf(out, size, " %02X", chip8->ram[(address + i) & RAM_MASK]);
+        }
+        debug_printf(out, size, "\n");
+    }
+    else if(strcmp(cmd, "d") == 0){
+        const uint16_t from = args >= 2 ? address : chip8->PC;
+        const uint32_t count = args >= 3 ? length : 8;
+        for(uint32_t i = 0; i < count; i++){
+            const uint16_t pc = (from + 2 * i) & RAM_MASK;
+            const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[(pc + 1) & RAM_MASK];
+            char text[32];
+            disassemble(opcode, text, sizeof text);
+            debug_printf(out, size, "%s%03X  %04X  %s\n", pc == chip8->PC ? "> " : "  ", pc, opcode, text);
+        }
+    }
+    else if(strcmp(cmd, "list") == 0){
+        for(uint32_t a = 0; a <= RAM_MASK; a++){
+            if(bitmap_get(debugger->breakpoints, a)) debug_printf(out, size, "break %03X\n", a);
+            if(bitmap_get(debugger->watch_read, a) || bitmap_get(debugger->watch_write, a)){
+                debug_printf(out, size, "watch %03X %s%s\n", a, bitmap_get(debugger->watch_read, a) ? "r" : "",
+                             bitmap_get(debugger->watch_write, a) ? "w" : "");
+            }
+        }
+        for(uint32_t i = 0; i < debugger->num_conds; i++){
+            const debug_cond_t *cond = &debugger->conds[i];
+            debug_printf(out, size, "cond %u %s %X\n", cond->reg, ops[cond->op], cond->value);
+        }
+    }
+    else if(strcmp(cmd, "q") == 0){
+        chip8->state = QUIT;
+    }
+    else if(strcmp(cmd, "help") == 0){
+        debug_printf(out, size,
+            "b/bd <addr>          set/delete PC breakpoint\n"
+            "w/r/a <addr> [len]   watch writes/reads/both\n"
+            "wd <addr> [len]      delete watches\n"
+            "cond <reg> <op> <v>  stop when e.g. \"cond v3 == 10\" becomes true, \"cond clear\"\n"
+            "s [n], c, stop       step n instructions, continue, stop\n"
+            "regs, set <reg> <v>  show/set registers\n"
+            "x <addr> [len]       dump memory\n"
+            "d [addr] [n]         disassemble n instructions, from PC by default\n"
+            "list, q              list breakpoints, quit\n"
+            "Numbers are hex\n");
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
+#ifdef CHIP8_POSIX
+// Read monitor commands from stdin without blocking, returns false once stdin is closed
+bool poll_monitor(debugger_t *debugger, chip8_t *chip8){
+    struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+    while(poll(&pfd, 1, 0) > 0){
+        char c;
+        if(read(STDIN_FILENO, &c, 1) != 1) return false;
+        if(c != '\n'){
+            if(debugger->line_len + 1 < sizeof debugger->line) debugger->line[debugger->line_len++] = c;
+            continue;
+        }
+
+        debugger->line[debugger->line_len] = '\0';
+        debugger->line_len = 0;
+
+        char out[4096] = "";
+        if(!debug_command(debugger, chip8, debugger->line, out, sizeof out)){
+            snprintf(out, sizeof out, "Unknown command, try help\n");
+        }
+        fputs(out, stdout);
+        if(debugger->stopped && debugger->reported && chip8->state != QUIT) fputs("(chip8) ", stdout); // Else the stop report prompts
+        fflush(stdout);
+    }
+    return true;
+}
+
+// GDB register sizes in bytes, V0-VF then I, PC, SP, DT, ST
+static inline uint32_t gdb_register_size(const uint32_t reg){
+    return (reg == REG_I || reg == REG_PC) ? 2 : 1;
+}
+
+// Target description, so GDB knows the register layout of the g packet
+static const char gdb_target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.chip8.core\">"
+#define GDB_V_REG(n) "<reg name=\"v" #n "\" bitsize=\"8\" type=\"uint8\"/>"
+    GDB_V_REG(0) GDB_V_REG(1) GDB_V_REG(2) GDB_V_REG(3) GDB_V_REG(4) GDB_V_REG(5) GDB_V_REG(6) GDB_V_REG(7)
+    GDB_V_REG(8) GDB_V_REG(9) GDB_V_REG(a) GDB_V_REG(b) GDB_V_REG(c) GDB_V_REG(d) GDB_V_REG(e) GDB_V_REG(f)
+#undef GDB_V_REG
+    "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>"
+    "</feature></target>";
+
+bool init_gdb_stub(gdb_stub_t *stub, const uint16_t port){
+    stub->fd = -1;
+    stub->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(stub->listen_fd < 0){
+        SDL_Log("Could not create GDB stub socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    const int one = 1;
+    setsockopt(stub->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    // Local connections only, the stub can read and write the whole machine
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if(bind(stub->listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(stub->listen_fd, 1) < 0){
+        SDL_Log("Could not listen for GDB on localhost:%u: %s\n", port, strerror(errno));
+        close(stub->listen_fd);
+        stub->listen_fd = -1;
+        return false;
+    }
+
+    printf("GDB stub listening on localhost:%u\n", port);
+    return true;
+}
+
+void close_gdb_stub(gdb_stub_t *stub){
+    if(stub->fd >= 0) close(stub->fd);
+    if(stub->listen_fd >= 0) close(stub->listen_fd);
+    stub->fd = stub->listen_fd = -1;
+}
+
+// Send one $data#checksum packet
+void gdb_send(gdb_stub_t *stub, const char *data){
+    static char packet[8192 + 4];
+    uint8_t checksum = 0;
+    size_t len = 0;
+
+    packet[len++] = '$';
+    for(const char *c = data; *c && len < sizeof packet - 3; c++){
+        packet[len++] = *c;
+        checksum += (uint8_t)*c;
+    }
+    len += snprintf(&packet[len], 4, "#%02x", checksum);
+
+    for(size_t sent = 0; sent < len;){
+        const ssize_t n = send(stub->fd, &packet[sent], len - sent, 0);
+        if(n <= 0) return;
+        sent += n;
+    }
+}
+
+void gdb_hex(char *out, const uint8_t *bytes, const size_t count){
+    for(size_t i = 0; i < count; i++) sprintf(&out[i * 2], "%02x", bytes[i]);
+}
+
+// Decode count bytes of hex, returns false on malformed input
+bool gdb_unhex(uint8_t *bytes, const char *hex, const size_t count){
+    for(size_t i = 0; i < count; i++){
+        if(!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1])) return false;
+        const char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+        bytes[i] = (uint8_t)strtoul(byte, NULL, 16);
+    }
+    return true;
+}
+
+void gdb_stop_reply(const debugger_t *debugger, char *reply, const size_t size){
+    const uint16_t address = debugger->stop_address;
+    switch(debugger->reason){
+        case STOP_WATCH_WRITE:
+        case STOP_WATCH_READ:
+            snprintf(reply, size, "T05%s:%x;",
+                     bitmap_get(debugger->watch_read, address) && bitmap_get(debugger->watch_write, address) ? "awatch" :
+                     debugger->reason == STOP_WATCH_WRITE ? "watch" : "rwatch", address);
+            break;
+        case STOP_INTERRUPT:
+            snprintf(reply, size, "S02"); // SIGINT
+            break;
+        default:
+            snprintf(reply, size, "S05"); // SIGTRAP
+            break;
+    }
+}
+
+// Handle one packet (without framing) and send its reply
+void gdb_handle_packet(gdb_stub_t *stub, debugger_t *debugger, chip8_t *chip8, const char *packet){
+    static char reply[8192];
+    reply[0] = '\0';
+
+    uint32_t address = 0, length = 0, type = 0;
+    switch(packet[0]){
+        case '?':
+            gdb_stop_reply(debugger, reply, sizeof reply);
+            break;
+
+        case 'g':
+            // All registers, little endian
+            for(uint32_t reg = 0, pos = 0; reg < REG_COUNT; reg++){
+                const uint16_t value = debug_get_register(chip8, reg);
+                const uint8_t bytes[2] = {value & 0xFF, value >> 8};
+                gdb_hex(&reply[pos], bytes, gdb_register_size(reg));
+                pos += 2 * gdb_register_size(reg);
+            }
+            break;
+
+        case 'G':
+            for(uint32_t reg = 0, pos = 1; reg < REG_COUNT; reg++){
+                uint8_t bytes[2] = {0};
+                if(strlen(&packet[pos]) < 2 * gdb_register_size(reg) ||
+                   !gdb_unhex(bytes, &packet[pos], gdb_register_size(reg))) break;
+                debug_set_register(debugger, chip8, reg, bytes[0] | bytes[1] << 8);
+                pos += 2 * gdb_register_size(reg);
+            }
+            snprintf(reply, sizeof reply, "OK");
+            break;
+
+        case 'p':
+            address = (uint32_t)strtoul(&packet[1], NULL, 16);
+            if(address < REG_COUNT){
+                const uint16_t value = debug_get_register(chip8, address);
+                const uint8_t bytes[2] = {value & 0xFF, value >> 8};
+                gdb_hex(reply, bytes, gdb_register_size(address));
+            }
+            else snprintf(reply, sizeof reply, "E01");
+            break;
+
+        case 'P': {
+            char *value;
+            address = (uint32_t)strtoul(&packet[1], &value, 16);
+            uint8_t bytes[2] = {0};
+            if(address < REG_COUNT && *value == '=' && gdb_unhex(bytes, value + 1, gdb_register_size(address))){
+                debug_set_register(debugger, chip8, address, bytes[0] | bytes[1] << 8);
+                snprintf(reply, sizeof reply, "OK");
+            }
+            else snprintf(reply, sizeof reply, "E01");
+            break;
+        }
+
+        case 'm':
+            // Read RAM, at most half the reply buffer of bytes
+            if(sscanf(packet, "m%x,%x", &address, &length) == 2 && address <= RAM_MASK &&
+               length <= sizeof reply / 2 - 1){
+                for(uint32_t i = 0; i < length; i++){
+                    gdb_hex(&reply[i * 2], &chip8->ram[(address + i) & RAM_MASK], 1);
+                }
+            }
+            else snprintf(reply, sizeof reply, "E01");
+            break;
+
+        case 'M': {
+            const char *data = strchr(packet, ':');
+            if(sscanf(packet, "M%x,%x", &address, &length) == 2 && address <= RAM_MASK && data &&
+               strlen(data + 1) >= 2 * length){
+                for(uint32_t i = 0; i < length; i++){
+                    gdb_unhex(&chip8->ram[(address + i) & RAM_MASK], data + 1 + 2 * i, 1);
+                    fuse_invalidate(chip8, address + i, 1);
+                }
+                debugger->modified = true;
+                snprintf(reply, sizeof reply, "OK");
+            }
+            else snprintf(reply, sizeof reply, "E01");
+            break;
+        }
+
+        case 'c':
+        case 's':
+            // Resume, the stop reply is sent once the machine stops again
+            if(packet[1]) debug_set_register(debugger, chip8, REG_PC, (uint16_t)strtoul(&packet[1], NULL, 16));
+            debug_resume(debugger, packet[0] == 's');
+            stub->running = true;
+            return;
+
+        case 'Z':
+        case 'z':
+            // Z0/Z1 breakpoint, Z2 write, Z3 read, Z4 access watchpoint
+            if(sscanf(&packet[1], "%u,%x,%x", &type, &address, &length) == 3 && type <= 4){
+                const bool on = packet[0] == 'Z';
+                if(type <= 1) debug_set_breakpoint(debugger, address, on);
+                else debug_set_watch(debugger, address, length, type != 2, type != 3, on);
+                snprintf(reply, sizeof reply, "OK");
+            }
+            break;
+
+        case 'k':
+            chip8->state = QUIT;
+            return;
+
+        case 'D':
+            // Detach: drop breakpoints and let the machine run
+            debug_clear_all(debugger);
+            if(debugger->stopped) debug_resume(debugger, 0);
+            gdb_send(stub, "OK");
+            close(stub->fd);
+            stub->fd = -1;
+            return;
+
+        case 'H':
+            snprintf(reply, sizeof reply, "OK"); // Only one thread
+            break;
+
+        case 'q':
+            if(strncmp(packet, "qSupported", strlen("qSupported")) == 0){
+                snprintf(reply, sizeof reply, "PacketSize=%x;qXfer:features:read+", (unsigned)sizeof stub->in);
+            }
+            else if(strcmp(packet, "qAttached") == 0){
+                snprintf(reply, sizeof reply, "1");
+            }
+            else if(sscanf(packet, "qXfer:features:read:target.xml:%x,%x", &address, &length) == 2){
+                // Chunk of the target description, "l" marks the last one
+                const size_t total = sizeof gdb_target_xml - 1;
+                const size_t start = address < total ? address : total;
+                const size_t count = length < total - start ? length : total - start;
+                const size_t max = sizeof reply - 2;
+                snprintf(reply, sizeof reply, "%c%.*s", start + count < total ? 'm' : 'l',
+                         (int)(count < max ? count : max), &gdb_target_xml[start]);
+            }
+            else if(strncmp(packet, "qRcmd,", strlen("qRcmd,")) == 0){
+                // "monitor <command>" runs a monitor command, the reply is its hex encoded output
+                char line[256] = "";
+                const size_t len = strlen(&packet[6]) / 2;
+                if(len < sizeof line) gdb_unhex((uint8_t *)line, &packet[6], len);
+
+                char out[sizeof reply / 2] = "";
+                if(!debug_command(debugger, chip8, line, out, sizeof out)) snprintf(out, sizeof out, "Unknown command\n");
+                if(out[0]) gdb_hex(reply, (const uint8_t *)out, strlen(out));
+                else snprintf(reply, sizeof reply, "OK");
+            }
+            break;
+
+        default:
+            break; // Empty reply, unsupported packet
+    }
+
+    gdb_send(stub, reply);
+}
+
+// Accept a client, read and handle its packets, and send a stop reply once
+// the machine stops after a continue/step
+void poll_gdb_stub(gdb_stub_t *stub, debugger_t *debugger, chip8_t *chip8){
+    if(stub->fd < 0){
+        struct pollfd pfd = {.fd = stub->listen_fd, .events = POLLIN};
+        if(poll(&pfd, 1, 0) <= 0) return;
+
+        stub->fd = accept(stub->listen_fd, NULL, NULL);
+        if(stub->fd < 0) return;
+
+        const int one = 1;
+        setsockopt(stub->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        stub->in_len = 0;
+        stub->running = false;
+        if(!debugger->stopped) debug_stop(debugger, STOP_INTERRUPT); // GDB expects a halted target
+    }
+
+    struct pollfd pfd = {.fd = stub->fd, .events = POLLIN};
+    while(stub->fd >= 0 && poll(&pfd, 1, 0) > 0){
+        const ssize_t n = recv(stub->fd, &stub->in[stub->in_len], sizeof stub->in - 1 - stub->in_len, 0);
+        if(n <= 0){
+            // Client went away, same as a detach
+            close(stub->fd);
+            stub->fd = -1;
+            debug_clear_all(debugger);
+            if(debugger->stopped) debug_resume(debugger, 0);
+            return;
+        }
+        stub->in_len += n;
+        stub->in[stub->in_len] = '\0';
+
+        size_t pos = 0;
+        while(pos < stub->in_len && stub->fd >= 0){
+            const char c = stub->in[pos];
+            if(c == 0x03){
+                // Ctrl-C from GDB
+                if(!debugger->stopped) debug_stop(debugger, STOP_INTERRUPT);
+                pos++;
+                continue;
+            }
+            if(c != '$'){
+                pos++; // Acks and noise
+                continue;
+            }
+
+            char *end = memchr(&stub->in[pos], '#', stub->in_len - pos);
+            if(!end || end + 2 >= &stub->in[stub->in_len]) break; // Incomplete packet
+
+            *end = '\0';
+            if(send(stub->fd, "+", 1, 0) != 1) break;
+            gdb_handle_packet(stub, debugger, chip8, &stub->in[pos + 1]);
+            pos = end + 3 - stub->in;
+        }
+
+        if(stub->fd < 0) return;
+        memmove(stub->in, &stub->in[pos], stub->in_len - pos);
+        stub->in_len -= pos;
+
+        // Drop a packet too big to ever complete
+        if(stub->in_len == sizeof stub->in - 1) stub->in_len = 0;
+    }
+
+    if(stub->fd >= 0 && stub->running && debugger->stopped){
+        char reply[64];
+        gdb_stop_reply(debugger, reply, sizeof reply);
+        gdb_send(stub, reply);
+        stub->running = false;
+    }
+}
+#endif
+
+// Poll the monitor and GDB stub once per frame and report new stops.
+// Returns true if a command wrote registers or RAM.
+bool poll_debugger(debugger_t *debugger, chip8_t *chip8, config_t *config, gdb_stub_t *gdb){
+#ifdef CHIP8_POSIX
+    if(config->monitor && !poll_monitor(debugger, chip8)){
+        // stdin closed, detach the monitor
+        config->monitor = false;
+        if(!config->gdb_port){
+            debug_clear_all(debugger);
+            if(debugger->stopped) debug_resume(debugger, 0);
+        }
+    }
+    if(config->gdb_port) poll_gdb_stub(gdb, debugger, chip8);
+
+    if(config->monitor && debugger->stopped && !debugger->reported){
+        char out[256] = "";
+        debug_print_stop(debugger, chip8, out, sizeof out);
+        printf("%s(chip8) ", out);
+        fflush(stdout);
+    }
+    debugger->reported = true;
+
+    const bool modified = debugger->modified;
+    debugger->modified = false;
+    return modified;
+#else
+    (void) debugger;
+    (void) chip8;
+    (void) config;
+    (void) gdb;
+    return false;
+#endif
+}
+
+// Decrement delay and sound timers, called at 60hz
+void tick_timers(chip8_t *chip8){
+    chip8->vblank_wait = false; // Timers tick on vblank, ending any display wait
+
+    if(chip8->delay_timer > 0){
+        chip8->delay_timer--;
+    }
+
+    if(chip8->sound_timer > 0){
+        chip8->sound_timer--;
+    }
+}
+
+// Unpause/pause the audio device
+void play_audio(const sdl_t sdl, const bool play){
+    if(!sdl.dev) return;
+
+    if(play && !audio_stats.playing){
+        // The gap while paused is not an underrun
+        __atomic_store_n(&audio_stats.last_callback, 0, __ATOMIC_RELAXED);
+    }
+    audio_stats.playing = play;
+    SDL_PauseAudioDevice(sdl.dev, play ? 0 : 1);
+}
+
+void update_timers(const sdl_t sdl, chip8_t *chip8){
+    // Play sound while sound timer is running, stop otherwise
+    play_audio(sdl, chip8->sound_timer > 0);
+
+    tick_timers(chip8);
+}
+
+// Emulate one 60hz frame with no SDL side effects, for speculative frames.
+// cycle_interpreter runs it with VIP timing, interpreter otherwise.
+// Returns the number of instructions run.
+uint32_t emulate_frame(chip8_t *chip8, const config_t *config, const interpreter_t interpreter,
+                       const cycle_interpreter_t cycle_interpreter){
+    if(config->vip_timing){
+        // Timers tick on the cycle clock's vblank, display DMA takes its share of the next frame
+        const uint32_t insts = cycle_interpreter(chip8, config, vip_frame_end(chip8->cycles));
+        tick_timers(chip8);
+        chip8->cycles += VIP_DISPLAY_CYCLES;
+        return insts;
+    }
+
+    const uint32_t insts = interpreter(chip8, config, config->insts_per_second / 60);
+    tick_timers(chip8);
+    return insts;
+}
+
+// Speculatively emulate run_ahead_frames past the real machine with the
+// current input and return the machine to display. While runahead->valid
+// the previous speculation only advances one frame. The caller clears it on
+// any input change, even one undone within the frame, or other outside change
+// to the real machine, and the speculation is rolled back to it and re-run.
+chip8_t *run_ahead(runahead_t *runahead, const chip8_t *chip8, const config_t *config,
+                   const interpreter_t interpreter, const cycle_interpreter_t cycle_interpreter){
+    if(runahead->valid){
+        emulate_frame(&runahead->ahead, config, interpreter, cycle_interpreter);
+    }
+    else{
+        copy_chip8(&runahead->ahead, chip8);
+        for(uint32_t i = 0; i < config->run_ahead_frames; i++){
+            emulate_frame(&runahead->ahead, config, interpreter, cycle_interpreter);
+        }
+        runahead->valid = true;
+        runahead->rollbacks++;
+    }
+
+    // The copy shares the real machine's colors, they keep lerping from what was last shown
+    return &runahead->ahead;
+}
+
+// Worker pool, pool_run() calls work(context, slice) once for every slice
+// 0..num_threads-1 and returns when all are done, the caller running slice 0
+typedef struct {
+    void (*work)(void *context, uint32_t slice);
+    void *context;
+    SDL_Thread **threads;
+    uint32_t num_threads;
+    SDL_mutex *lock;
+    SDL_cond *start, *finished;
+    uint32_t generation; // Bumped to start a run
+    uint32_t pending; // Workers still running the current run
+    bool quit;
+} pool_t;
+
+// Worker thread argument
+typedef struct {
+    pool_t *pool;
+    uint32_t slice;
+} pool_worker_t;
+
+int pool_worker_thread(void *data){
+    pool_worker_t *worker = (pool_worker_t *) data;
+    pool_t *pool = worker->pool;
+    uint32_t seen = 0;
+
+    SDL_LockMutex(pool->lock);
+    while(true){
+        while(pool->generation == seen && !pool->quit){
+            SDL_CondWait(pool->start, pool->lock);
+        }
+        if(pool->quit) break;
+        seen = pool->generation;
+        SDL_UnlockMutex(pool->lock);
+
+        pool->work(pool->context, worker->slice);
+
+        SDL_LockMutex(pool->lock);
+        if(--pool->pending == 0) SDL_CondSignal(pool->finished);
+    }
+    SDL_UnlockMutex(pool->lock);
+
+    free(worker);
+    return 0;
+}
+
+void close_pool(pool_t *pool){
+    if(pool->lock){
+        SDL_LockMutex(pool->lock);
+        pool->quit = true;
+        SDL_CondBroadcast(pool->start);
+        SDL_UnlockMutex(pool->lock);
+    }
+    for(uint32_t t = 1; pool->threads && t < pool->num_threads; t++){
+        if(pool->threads[t]) SDL_WaitThread(pool->threads[t], NULL);
+    }
+
+    SDL_DestroyCond(pool->finished);
+    SDL_DestroyCond(pool->start);
+    SDL_DestroyMutex(pool->lock);
+    free(pool->threads);
+    *pool = (pool_t){0};
+}
+
+// Start threads - 1 workers, threads = 0 for one per CPU, at most max_threads
+bool init_pool(pool_t *pool, uint32_t threads, const uint32_t max_threads,
+               void (*work)(void *context, uint32_t slice), void *context){
+    *pool = (pool_t){.work = work, .context = context};
+
+    if(threads == 0) threads = (uint32_t)SDL_GetCPUCount();
+    if(threads > max_threads) threads = max_threads;
+    if(threads == 0) threads = 1;
+    pool->num_threads = threads;
+
+    pool->lock = SDL_CreateMutex();
+    pool->start = SDL_CreateCond();
+    pool->finished = SDL_CreateCond();
+    pool->threads = calloc(threads, sizeof *pool->threads);
+    if(!pool->lock || !pool->start || !pool->finished || !pool->threads){
+        close_pool(pool);
+        return false;
+    }
+
+    for(uint32_t t = 1; t < threads; t++){
+        pool_worker_t *worker = malloc(sizeof *worker);
+        if(!worker){
+            close_pool(pool);
+            return false;
+        }
+        *worker = (pool_worker_t){.pool = pool, .slice = t};
+        pool->threads[t] = SDL_CreateThread(pool_worker_thread, "chip8_pool", worker);
+        if(!pool->threads[t]){
+            free(worker);
+            close_pool(pool);
+            return false;
+        }
+    }
+    return true;
+}
+
+void pool_run(pool_t *pool){
+    if(pool->num_threads > 1){
+        SDL_LockMutex(pool->lock);
+        pool->pending = pool->num_threads - 1;
+        pool->generation++;
+        SDL_CondBroadcast(pool->start);
+        SDL_UnlockMutex(pool->lock);
+    }
+
+    pool->work(pool->context, 0);
+
+    if(pool->num_threads > 1){
+        SDL_LockMutex(pool->lock);
+        while(pool->pending > 0){
+            SDL_CondWait(pool->finished, pool->lock);
+        }
+        SDL_UnlockMutex(pool->lock);
+    }
+}
+
+#if !defined(CHIP8_LIBRARY) && !defined(CHIP8_FUZZ) && !defined(CHIP8_TEST)
+// Multi-session host, for --session: the first ROM and every --session ROM
+// run as sessions with their own machine and config (ROM profiles apply per
+// session) in one process. Workers step the sessions and copy their colors
+// into a tile each of one atlas, the main thread uploads it as one texture
+// and presents once per frame, and one audio device mixes every beeping
+// session. Run-ahead, capture, shared memory and the debugger are single
+// machine features and are not available here.
+
+// One hosted machine
+typedef struct {
+    chip8_t *chip8; // From the host's machine arena
+    config_t config; // Command line plus the ROM's profile
+    interpreter_t interpreter;
+    cycle_interpreter_t cycle_interpreter;
+    uint32_t column, row; // Tile in the atlas
+    bool beeping; // Sound timer running, read by the audio callback
+    uint32_t sample_index; // Square wave position, audio callback only
+} session_t;
+
+typedef struct {
+    session_t *sessions;
+    uint32_t count;
+    uint32_t columns, rows; // Atlas size in tiles
+    machine_arena_t machines;
+    rom_image_t *images; // Sessions running the same ROM and quirks share one
+    uint32_t num_images;
+    uint32_t *pixel_colors; // Every session's pixel_color, NULL when headless
+    uint32_t *atlas; // columns*64 x rows*32 RGBA8888 pixels, NULL when headless
+    uint32_t tile_scale; // Window pixels per CHIP8 pixel
+    uint32_t focus; // Session keys go to, unless route_keymap
+    bool paused;
+    pool_t pool;
+    uint64_t *slice_insts; // Instructions each pool slice ran in the last frame, for the metrics
+} host_t;
+
+// Worker: one frame of a slice of the sessions, drawn into their tiles
+void host_step_slice(void *context, const uint32_t slice){
+    host_t *host = (host_t *) context;
+    const uint32_t first = (uint32_t)((uint64_t)host->count * slice / host->pool.num_threads);
+    const uint32_t last = (uint32_t)((uint64_t)host->count * (slice + 1) / host->pool.num_threads);
+    const uint32_t pitch = host->columns * 64;
+
+    uint64_t insts = 0;
+    for(uint32_t i = first; i < last; i++){
+        session_t *session = &host->sessions[i];
+        insts += emulate_frame(session->chip8, &session->config, session->interpreter,
+                               session->cycle_interpreter);
+        __atomic_store_n(&session->beeping, session->chip8->sound_timer > 0, __ATOMIC_RELAXED);
+
+        if(!host->atlas) continue;
+        update_pixel_colors(session->config, session->chip8);
+        uint32_t *tile = &host->atlas[session->row * 32 * pitch + session->column * 64];
+        for(uint32_t y = 0; y < 32; y++){
+            memcpy(&tile[y * pitch], &session->chip8->pixel_color[y * 64], 64 * sizeof(uint32_t));
+        }
+    }
+    host->slice_insts[slice] = insts;
+}
+
+// Mix the square waves of every beeping session
+void host_audio_callback(void *userdata, uint8_t *stream, int len){
+    host_t *host = (host_t *) userdata;
+    int16_t *audio_data = (int16_t *) stream;
+    audio_stats_callback();
+
+    memset(stream, 0, len);
+    for(uint32_t s = 0; s < host->count; s++){
+        session_t *session = &host->sessions[s];
+        if(!__atomic_load_n(&session->beeping, __ATOMIC_RELAXED)) continue;
+
+        const config_t *config = &session->config;
+        const int32_t half_period = config->audio_sample_rate / config->square_wave_freq / 2;
+        for(int i = 0; i < len / 2; i++){
+            const int32_t wave = ((session->sample_index++ / (half_period ? half_period : 1)) % 2) ?
+                                 config->volume : -config->volume;
+            const int32_t sample = audio_data[i] + wave;
+            audio_data[i] = (int16_t)(sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample);
+        }
+    }
+}
+
+// A keypad key for the focused session, or every session with route_keymap
+void host_key(host_t *host, const config_t *config, const SDL_Keycode sym, const bool down){
+    for(uint32_t s = 0; s < host->count; s++){
+        if(!config->route_keymap && s != host->focus) continue;
+
+        session_t *session = &host->sessions[s];
+        for(uint8_t key = 0; key < 16; key++){
+            if(sym == session->config.keymap[key]) session->chip8->keypad[key] = down;
+        }
+    }
+}
+
+void host_set_focus(host_t *host, const uint32_t focus){
+    if(focus >= host->count || focus == host->focus) return;
+
+    // Keys held on the old session would stay down forever
+    memset(host->sessions[host->focus].chip8->keypad, 0, sizeof host->sessions[host->focus].chip8->keypad);
+    host->focus = focus;
+}
+
+// Host input, clicking a tile or Tab moves the focus. Returns false on quit.
+bool host_input(host_t *host, config_t *config){
+    SDL_Event event;
+    while(SDL_PollEvent(&event)){
+        switch(event.type){
+            case SDL_QUIT:
+                return false;
+
+            case SDL_MOUSEBUTTONDOWN: {
+                const uint32_t column = (uint32_t)event.button.x / (64 * host->tile_scale);
+                const uint32_t row = (uint32_t)event.button.y / (32 * host->tile_scale);
+                if(column < host->columns) host_set_focus(host, row * host->columns + column);
+                break;
+            }
+
+            case SDL_KEYDOWN:
+                switch(event.key.keysym.sym){
+                    case SDLK_ESCAPE:
+                        return false;
+                    case SDLK_SPACE:
+                        // Pause/Unpause every session
+                        host->paused = !host->paused;
+                        if(host->paused) puts("==== PAUSED ====");
+                        break;
+                    case SDLK_EQUALS: {
+                        // "=" Reset the focused session
+                        session_t *session = &host->sessions[host->focus];
+                        reset_chip8(session->chip8, session->config, session->chip8->image);
+                        break;
+                    }
+                    case SDLK_TAB:
+                        host_set_focus(host, (host->focus + 1) % host->count);
+                        break;
+                    case SDLK_F1:
+                        config->hud = !config->hud;
+                        break;
+                    default:
+                        host_key(host, config, event.key.keysym.sym, true);
+                        break;
+                }
+                break;
+
+            case SDL_KEYUP:
+                host_key(host, config, event.key.keysym.sym, false);
+                break;
+
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+// Run every session until quit or max_frames, returns false on setup failure
+bool run_host(config_t *config, const int argc, char **argv){
+    host_t host = {.count = 1 + config->num_sessions};
+    host.sessions = calloc(host.count, sizeof *host.sessions);
+    host.images = malloc(host.count * sizeof *host.images);
+    host.pixel_colors = config->headless ? NULL : calloc((size_t)host.count * 64*32, sizeof *host.pixel_colors);
+    if(!host.sessions || !host.images || (!config->headless && !host.pixel_colors) ||
+       !init_machine_arena(&host.machines, host.count)){
+        SDL_Log("Could not allocate %u sessions\n", (unsigned)host.count);
+        return false;
+    }
+
+    // Near square grid of tiles
+    host.columns = 1;
+    while(host.columns * host.columns < host.count) host.columns++;
+    host.rows = (host.count + host.columns - 1) / host.columns;
+
+    for(uint32_t i = 0; i < host.count; i++){
+        session_t *session = &host.sessions[i];
+        const char *rom_name = (i == 0) ? argv[1] : config->session_roms[i - 1];
+        session->config = *config;
+        session->column = i % host.columns;
+        session->row = i / host.columns;
+
+        session->chip8 = alloc_machine(&host.machines);
+        if(host.pixel_colors) session->chip8->pixel_color = &host.pixel_colors[i * 64*32];
+
+        rom_image_t *image = &host.images[host.num_images];
+        bool profiled = false;
+        if(!init_chip8(session->chip8, image, session->config, rom_name)) return false;
+        if(config->profile_db &&
+           !apply_rom_profile(&session->config, argc, argv, image->hash, &profiled)) return false;
+        if(profiled && !init_chip8(session->chip8, image, session->config, rom_name)) return false;
+
+        const rom_image_t *shared = share_rom_image(host.images, host.num_images, image);
+        if(shared == image) host.num_images++;
+        else reset_chip8(session->chip8, session->config, shared);
+
+        session->interpreter = select_interpreter(&session->config);
+        session->cycle_interpreter = select_cycle_interpreter(&session->config);
+    }
+
+    // The window keeps the single machine size, tiles share it
+    sdl_t sdl = {0};
+    SDL_Texture *texture = NULL;
+    if(!config->headless){
+        host.tile_scale = config->scale_factor / host.columns ? config->scale_factor / host.columns : 1;
+        config_t window = *config;
+        window.window_width = host.columns * 64;
+        window.window_height = host.rows * 32;
+        window.scale_factor = host.tile_scale;
+
+        char name[32];
+        snprintf(name, sizeof name, "%u sessions", (unsigned)host.count);
+        if(!init_sdl(&sdl, &window, name, host_audio_callback, &host)) return false;
+
+        texture = SDL_CreateTexture(sdl.renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+                                    window.window_width, window.window_height);
+        host.atlas = calloc((size_t)window.window_width * window.window_height, sizeof *host.atlas);
+        if(!texture || !host.atlas){
+            SDL_Log("Could not create the %ux%u session atlas %s\n", (unsigned)window.window_width,
+                    (unsigned)window.window_height, SDL_GetError());
+            return false;
+        }
+    }
+
+    if(!init_pool(&host.pool, config->threads, host.count, host_step_slice, &host)){
+        SDL_Log("Could not start session threads\n");
+        return false;
+    }
+    host.slice_insts = calloc(host.pool.num_threads, sizeof *host.slice_insts);
+    if(!host.slice_insts){
+        SDL_Log("Could not allocate %u sessions\n", (unsigned)host.count);
+        return false;
+    }
+
+    metrics_t metrics;
+    if(!init_metrics(&metrics, *config)) return false;
+    const bool measure = !config->headless || config->metrics_file;
+
+    uint32_t frames = 0;
+    uint64_t total_insts = 0;
+    const uint64_t start_time = SDL_GetPerformanceCounter();
+    frame_pacer_t pacer;
+    init_pacer(&pacer);
+    while(true){
+        if(!config->headless && !host_input(&host, config)) break;
+
+        if(host.paused){
+            play_audio(sdl, false);
+            pacer_hold(&pacer);
+            metrics_hold(&metrics);
+            SDL_Delay(1);
+            continue;
+        }
+
+        // Every session's frame, in parallel
+        const uint64_t emulate_start = measure ? SDL_GetPerformanceCounter() : 0;
+        pool_run(&host.pool);
+        for(uint32_t t = 0; t < host.pool.num_threads; t++) total_insts += host.slice_insts[t];
+
+        bool beeping = false;
+        for(uint32_t i = 0; i < host.count; i++) beeping |= host.sessions[i].beeping;
+        play_audio(sdl, beeping);
+        const double emulate_ms = measure ? elapsed_ms(emulate_start) : 0;
+
+        double render_ms = 0, present_ms = 0;
+        if(!config->headless){
+            if(pacer_should_present(&pacer, config->max_skip)){
+                const uint64_t render_start = SDL_GetPerformanceCounter();
+                SDL_UpdateTexture(texture, NULL, host.atlas, (int)(host.columns * 64 * sizeof *host.atlas));
+                SDL_RenderCopy(sdl.renderer, texture, NULL, NULL);
+
+                // Outline the session keys go to
+                if(host.count > 1 && !config->route_keymap){
+                    const session_t *focus = &host.sessions[host.focus];
+                    const int w = 64 * host.tile_scale, h = 32 * host.tile_scale;
+                    const SDL_Rect rect = {.x = focus->column * w, .y = focus->row * h, .w = w, .h = h};
+                    SDL_SetRenderDrawColor(sdl.renderer, (config->fg_color >> 24) & 0xFF,
+                                           (config->fg_color >> 16) & 0xFF, (config->fg_color >> 8) & 0xFF, 0xFF);
+                    SDL_RenderDrawRect(sdl.renderer, &rect);
+                }
+
+                if(config->hud) draw_hud(sdl, *config, &metrics);
+                render_ms = elapsed_ms(render_start);
+
+                const uint64_t present_start = SDL_GetPerformanceCounter();
+                SDL_RenderPresent(sdl.renderer);
+                present_ms = elapsed_ms(present_start);
+                pacer.render_ms += render_ms + present_ms;
+            }
+            pacer_end_frame(&pacer, config->max_skip);
+        }
+
+        if(measure){
+            metrics_frame(&metrics, emulate_ms, render_ms, present_ms);
+            if(metrics_update(&metrics, *config, &pacer, total_insts) && !config->headless){
+                char title[128];
+                snprintf(title, sizeof title, "CHIP8 Emulator - %u sessions - %.0f IPS, %.1f fps",
+                         (unsigned)host.count, metrics.ips, metrics.fps);
+                SDL_SetWindowTitle(sdl.window, title);
+            }
+        }
+
+        frames++;
+        if(config->max_frames && frames >= config->max_frames) break;
+    }
+
+    if(config->headless){
+        const double seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+        printf("Hosted %u sessions on %u threads for %u frames, %llu instructions in %.3f s (%.0f instructions/s)\n",
+               (unsigned)host.count, (unsigned)host.pool.num_threads, (unsigned)frames,
+               (long long unsigned)total_insts, seconds, total_insts / seconds);
+    }
+    else{
+        print_pacer_stats(&pacer);
+    }
+
+    close_metrics(&metrics);
+    close_pool(&host.pool);
+    if(!config->headless){
+        SDL_DestroyTexture(texture);
+        final_cleanup(sdl); // Closes audio before the sessions its callback reads are freed
+    }
+    free(host.slice_insts);
+    free(host.atlas);
+    close_machine_arena(&host.machines);
+    free(host.pixel_colors);
+    free(host.images);
+    free(host.sessions);
+    return true;
+}
+
+// Main function
+int main(int argc, char **argv){
+    // Default Usage message for args
+    if(argc < 2){
+        fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    //puts("TESTING CHIP 8");
+
+    // Init emulator configuration
+    config_t config = {0};
+    if(!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
+
+    // Several ROMs share one process and window
+    if(config.num_sessions) exit(run_host(&config, argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    const char *rom_name = argv[1];
+
+    // Seed random number generator, used to seed the machine's own CXNN state
+    srand(time(NULL));
+
+    // Initialize CHIP8 machine
+    static rom_image_t image;
+    _Alignas(CACHE_LINE) chip8_t chip8 = {0};
+    
+    if(!init_chip8(&chip8, &image, config, rom_name)) exit(EXIT_FAILURE);
+
+    // Per-ROM profile, looked up by the ROM's hash. The machine is set up
+    // again since its fused operations and colors depend on the config.
+    bool profiled = false;
+    if(config.profile_db && !apply_rom_profile(&config, argc, argv, image.hash, &profiled)) exit(EXIT_FAILURE);
+    if(profiled && !init_chip8(&chip8, &image, config, rom_name)) exit(EXIT_FAILURE);
+    if(config.save_profile && !save_rom_profile(config.save_profile, image.hash, rom_name, argc, argv)){
+        exit(EXIT_FAILURE);
+    }
+
+    // Render state, only for a machine that something draws
+    static uint32_t pixel_color[64*32];
+    if(!config.headless || config.capture_file || config.screenshot_file || config.shm_name){
+        chip8.pixel_color = pixel_color;
+        for(uint32_t i = 0; i < 64*32; i++){
+            pixel_color[i] = config.bg_color;
+        }
+    }
+
+    // Initialize SDL
+    sdl_t sdl = {0};
+    if(!config.headless && !init_sdl(&sdl, &config, rom_name, audio_callback, &config)) exit(EXIT_FAILURE);
+
+    // Static analysis of the loaded ROM, if requested
+    if(config.analysis_file){
+        static analysis_t analysis;
+        analyze_rom(&analysis, chip8.ram, &config);
+        if(!write_analysis(&analysis, &chip8, config.analysis_file)) exit(EXIT_FAILURE);
+        printf("ROM analysis: %u instructions in %u blocks, %u self-modifying code bytes%s\n",
+               analysis.instructions, analysis.blocks, analysis.smc_bytes,
+               analysis.unknown_writes ? " (plus writes through an unknown I)" : "");
+    }
+
+    // Start frame capture, if requested
+    capture_t capture = {0};
+    if(config.capture_file && !init_capture(&capture, config)) exit(EXIT_FAILURE);
+
+    // Initial screen clear
+    if(!config.headless) clear_screen(sdl, config);
+
+    // Pick the quirk specialized interpreter once
+    const interpreter_t interpreter = select_interpreter(&config);
+    const cycle_interpreter_t cycle_interpreter = select_cycle_interpreter(&config);
+
+    // Speculative machine for run-ahead
+    runahead_t runahead = {0};
+
+    // Shared memory export, if requested
+    shm_export_t shm_export = {0};
+    if(config.shm_name && !init_shm_export(&shm_export, config)) exit(EXIT_FAILURE);
+
+    // Input latency measurement
+    latency_t latency = {0};
+    latency_t *const latency_ptr = config.latency_stats ? &latency : NULL;
+
+    // Debugger, the checked interpreter only runs while something is armed.
+    // With the monitor or GDB stub the machine starts stopped at the entry point.
+    debugger_t debugger = {0};
+    gdb_stub_t gdb = {.listen_fd = -1, .fd = -1};
+    const checked_interpreter_t checked_interpreter = select_checked_interpreter(&config);
+    const bool debugging = config.monitor || config.gdb_port;
+    if(config.gdb_port && !init_gdb_stub(&gdb, config.gdb_port)) exit(EXIT_FAILURE);
+    if(config.monitor) puts("Monitor on stdin, type help for commands, c to start");
+    if(debugging) debug_stop(&debugger, STOP_INTERRUPT);
+
+    // Main emulator loop
+    chip8_t *shown = &chip8; // Machine last displayed, the run-ahead one with --run-ahead
+    uint32_t frames = 0;
+    uint32_t insts_left = 0; // Of the current frame, kept while the debugger stops it
+    uint64_t frame_start = 0; // Cycle clock when the current frame started, with VIP timing
+    uint64_t total_insts = 0;
+    const uint64_t start_time = SDL_GetPerformanceCounter();
+    frame_pacer_t pacer;
+    init_pacer(&pacer);
+
+    // Performance metrics, for the HUD, window title and --metrics.
+    // Headless runs only pay for the timing when --metrics asks for it.
+    metrics_t metrics;
+    if(!init_metrics(&metrics, config)) exit(EXIT_FAILURE);
+    const bool measure = !config.headless || config.metrics_file;
+    while(chip8.state != QUIT){
+        // Handle user input, a reset or key change invalidates any run-ahead speculation
+        if(!config.headless && handle_input(&chip8, &config, latency_ptr)) runahead.valid = false;
+
+        if(chip8.state == PAUSED){
+            pacer_hold(&pacer);
+            metrics_hold(&metrics);
+            continue;
+        }
+
+        // Debugger commands, a stopped machine only waits for them. Like a
+        // reset, writing registers or RAM invalidates run-ahead speculation.
+        if(debugging){
+            if(poll_debugger(&debugger, &chip8, &config, &gdb)) runahead.valid = false;
+            if(debugger.stopped){
+                pacer_hold(&pacer);
+                metrics_hold(&metrics);
+                SDL_Delay(1);
+                continue;
+            }
+        }
 
-            break;
-        case 0x0C:
-            // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
-            printf("Set V%X = rand() %% 256 & NN (0x%02X)\n",
-                chip8->inst.X, chip8->inst.NN);
+        // Keys from shared memory readers
+        if(config.shm_name && poll_shm_input(&shm_export, &chip8)) runahead.valid = false;
 
-            break;
-        case 0x0E:
-            if(chip8->inst.NN == 0x9E){
-                // 0xEX9E: Skip next instruction if key in VX is pressed
-                printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n",
-                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
+        // Emulate CHIP8 Instructions for this emulator "frame" (60 hz),
+        // polling input again between slices so key presses are seen within the frame.
+        // With VIP timing slices split the frame's cycle budget instead. A frame
+        // cut short by the debugger or a pause resumes where it stopped, slices
+        // it already ran are skipped.
+        const uint64_t emulate_start = measure ? SDL_GetPerformanceCounter() : 0;
+        const uint32_t frame_insts = config.insts_per_second / 60;
+        if(chip8.cycles < frame_start) frame_start = chip8.cycles; // A reset restarts the cycle clock
+        const uint64_t frame_end = vip_frame_end(chip8.cycles);
+        if(insts_left == 0) insts_left = frame_insts;
+        for(uint32_t slice = 0; slice < config.input_slices && chip8.state == RUNNING && !chip8.vblank_wait; slice++){
+            // Instructions left in the frame once this slice is done, or with
+            // VIP timing the cycle it ends on, an even share of the frame's cycles
+            const uint32_t slice_left = frame_insts - frame_insts * (slice + 1) / config.input_slices;
+            const uint64_t until = frame_start + (frame_end - frame_start) * (slice + 1) / config.input_slices;
+            if(config.vip_timing ? chip8.cycles >= until : insts_left <= slice_left) continue;
+
+            if(slice > 0 && !config.headless && handle_input(&chip8, &config, latency_ptr)){
+                runahead.valid = false;
             }
-            else if(chip8->inst.NN == 0xA1){
-                printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n",
-                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
+
+            if(config.vip_timing){
+                if(debugger.armed){
+                    while(chip8.cycles < until && !debugger.stopped){
+                        total_insts += checked_interpreter(&chip8, &config, &debugger, 1);
+                    }
+                    if(debugger.stopped) break;
+                }
+                else{
+                    total_insts += cycle_interpreter(&chip8, &config, until);
+                }
+                continue;
             }
-            break;
-        case 0x0F:
-            switch(chip8->inst.NN){
-                case 0x0A:
-                    // 0xFX0A: VX = get_key(): Await until a keypress, an store in VX
-                    printf("Await until a key is pressed; Store key in V%X\n", chip8->inst.X);
-                    break;
 
-                case 0x1E:
-                    // 0xFX1E: I += VX; Add VX to register I. For non-Aniga CHIP8, does not affect VF
-                    printf("I (0x%04X) += V%X (0x%02X) Result (I): 0x%04X\n",
-                        chip8->I, chip8->inst.X, chip8->V[chip8->inst.X], chip8->I + chip8->V[chip8->inst.X]);
-                    break;
-                case 0x07:
-                    // 0xFX07: Set VX to delay timer value
-                    printf("Set V%X = delay timer value (0x%02X)\n", chip8->inst.X, chip8->delay_timer);
-                    break;
-                case 0x15:
-                    // 0xFX15: Set delay timer to VX
-                    printf("Set delay timer = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-                    break;
-                case 0x18:
-                    // 0xFX18: Set sound timer to VX
-                    printf("Set delay timer = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-                    break;
-                case 0x29:
-                    // 0xFX29: Set register I to location of sprite for digit VX
-                    printf("Set I to sprite location in memory for characters in V%X (0x%02X). Result(VX*5) = (0x%02X) \n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
-                    break;
-                case 0x33:
-                    // 0xFX33: Store BCD representation of VX in memory locations I, I+1, I+2
-                    printf("Store BCD representation of V%X (0x%02X) in memory locations I (0x%04X), I+1, I+2\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-                    break;
-                case 0x55:
-                    // 0xFX55: Store V0 to VX in memory starting at I
-                    printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04x)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-                    break;
-                case 0x65:
-                    // 0xFX65: Store V0 to VX in memory starting at I
-                    printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04x)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
-                    break;
-                default:
-                    // Wrong/unimplemented opcode
-                    break;
+            const uint32_t slice_insts = insts_left - slice_left;
+            if(debugger.armed){
+                const uint32_t ran = checked_interpreter(&chip8, &config, &debugger, slice_insts);
+                insts_left -= ran;
+                total_insts += ran;
+                if(debugger.stopped) break;
             }
-            break;
+            else{
+                const uint32_t ran = interpreter(&chip8, &config, slice_insts);
+                insts_left -= ran;
+                total_insts += ran;
+            }
+        }
+        if(debugger.stopped) runahead.valid = false; // Frame cut short, the speculation ran all of it
 
-        default:
-            printf("Unimplemented Opcode\n");
-            break;
+        // The frame ends on the cycle clock's vblank with VIP timing, otherwise
+        // once its instructions ran or a display wait gave up the rest of them.
+        // Until then timers don't tick and nothing is presented.
+        if(config.vip_timing ? chip8.cycles < frame_end : insts_left > 0 && !chip8.vblank_wait){
+            continue;
+        }
+        insts_left = 0;
+
+        // Update delays and sound timers
+        update_timers(sdl, &chip8);
+        if(config.vip_timing) chip8.cycles += VIP_DISPLAY_CYCLES; // Display DMA and the interrupt come out of the next frame
+        frame_start = chip8.cycles;
+
+        // The interpreter only counts violations, trap on them once per frame
+        if(config.trap_violations && count_violations(&chip8.violations)){
+            SDL_Log("Memory safety violation, stopping at PC 0x%04X\n", chip8.PC);
+            print_violations(&chip8);
+            chip8.state = QUIT;
+        }
+
+        // With run-ahead, show a machine emulated ahead with the current input.
+        // The window, capture, shared memory and screenshot all use this machine.
+        shown = &chip8;
+        if(config.run_ahead_frames) shown = run_ahead(&runahead, &chip8, &config, interpreter, cycle_interpreter);
+        const double emulate_ms = measure ? elapsed_ms(emulate_start) : 0;
+
+        double render_ms = 0, present_ms = 0;
+        if(!config.headless){
+            // Keep game time at 60hz, presenting only when the renderer keeps up
+            if(pacer_should_present(&pacer, config.max_skip)){
+                const uint64_t render_start = SDL_GetPerformanceCounter();
+                update_screen(sdl, config, shown);
+                if(config.hud) draw_hud(sdl, config, &metrics);
+                render_ms = elapsed_ms(render_start);
+
+                const uint64_t present_start = SDL_GetPerformanceCounter();
+                SDL_RenderPresent(sdl.renderer);
+                present_ms = elapsed_ms(present_start);
+                pacer.render_ms += render_ms + present_ms;
+
+                if(config.latency_stats) latency_presented(&latency, shown);
+            }
+            else{
+                // Dropped present, colors still lerp at game time
+                update_pixel_colors(config, shown);
+            }
+            pacer_end_frame(&pacer, config.max_skip);
+        }
+        else if(config.capture_file || config.screenshot_file || config.shm_name){
+            // No window to draw, but capture/screenshot/shm still need the lerped colors
+            update_pixel_colors(config, shown);
+        }
+
+        // Record this frame
+        if(config.capture_file) capture_frame(&capture, shown);
+        if(config.shm_name) publish_shm(&shm_export, shown);
+
+        if(measure){
+            metrics_frame(&metrics, emulate_ms, render_ms, present_ms);
+            if(metrics_update(&metrics, config, &pacer, total_insts) && !config.headless){
+                char title[192];
+                snprintf(title, sizeof title, "CHIP8 Emulator - %s - %.0f IPS, %.1f fps", rom_name, metrics.ips,
+                         metrics.fps);
+                SDL_SetWindowTitle(sdl.window, title);
+            }
+        }
+
+        frames++;
+        if(config.max_frames && frames >= config.max_frames) chip8.state = QUIT;
     }
-    
+
+    if(config.headless){
+        const double seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+        printf("Emulated %u frames, %llu instructions in %.3f s (%.0f instructions/s)\n",
+               (unsigned)frames, (long long unsigned)total_insts, seconds, total_insts / seconds);
+    }
+
+    if(config.vip_timing && frames){
+        printf("VIP timing: %llu machine cycles, %.1f instructions per frame\n",
+               (long long unsigned)chip8.cycles, (double)total_insts / frames);
+    }
+
+    if(config.run_ahead_frames){
+        printf("Run-ahead: %u frames ahead, %llu rollbacks in %u frames\n", (unsigned)config.run_ahead_frames,
+               (long long unsigned)runahead.rollbacks, (unsigned)frames);
+    }
+
+    if(!config.headless) print_pacer_stats(&pacer);
+
+    if(config.latency_stats) print_latency_stats(&latency);
+    close_metrics(&metrics);
+    if(!config.trap_violations && count_violations(&chip8.violations)) print_violations(&chip8);
+
+    // Final cleanup
+    if(config.screenshot_file) save_screenshot(shown, config, config.screenshot_file);
+    if(config.capture_file) close_capture(&capture);
+    if(config.shm_name) close_shm_export(&shm_export);
+#ifdef CHIP8_POSIX
+    if(config.gdb_port) close_gdb_stub(&gdb);
+#endif
+    if(!config.headless) final_cleanup(sdl);
+
+    exit(EXIT_SUCCESS);
 }
 #endif
 
-// Emulate 1 CHIP8 instruction
-void emulate_instructions(chip8_t *chip8, const config_t config){
-    bool carry; // Save the carry flag/VF value for some instructions
+#ifdef CHIP8_LIBRARY
+// Batched environment API (chip8_env.h), built with make lib
 
-    // Get next opcode from ram
-    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
-    chip8->PC += 2; // Pre-increment program counter for next opcode
+// One reward hook
+typedef struct {
+    uint16_t address;
+    uint8_t length;
+    float scale;
+} env_reward_t;
 
-    // Fill out instruction format
-    //chip8->inst.category = (chip8->inst.opcode >> 12) & 0x0F;
-    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-    chip8->inst.NN = chip8->inst.opcode & 0x0FF;
-    chip8->inst.N = chip8->inst.opcode & 0x0F;
-    chip8->inst.X = (chip8->inst.opcode >> 8) & 0x0F;
-    chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x0F;
+struct chip8_env {
+    config_t config;
+    interpreter_t interpreter;
+    cycle_interpreter_t cycle_interpreter;
+    rom_image_t image; // Shared by every machine
+    chip8_t initial; // Machine right after loading the ROM, copied on reset
+    machine_arena_t machines; // num_envs machines, see env_machine()
+    uint32_t num_envs;
+    uint64_t seed;
+    uint32_t *episodes; // Per env reset count, mixed into the CXNN seed
 
-#ifdef DEBUG
-    print_debug_info(chip8);
-#endif
+    // Output buffers, rewritten in place every step
+    uint8_t *observations;
+    uint8_t *grayscale;
+    float *rewards;
+    uint8_t *dones;
 
-    // Emulate opcode
-    switch((chip8->inst.opcode >> 12) & 0x0F){
-        case 0x00:
-            if(chip8->inst.NN == 0xE0){
-                // 0x00E0: Clear screen
-                memset(&chip8->display[0], false, sizeof chip8->display);
-                chip8->draw = true; // Will update screen on next 60 hz tick
+    env_reward_t reward_hooks[CHIP8_ENV_MAX_REWARDS];
+    uint32_t num_rewards;
+    uint32_t *reward_values; // num_envs * CHIP8_ENV_MAX_REWARDS values at last step
+    bool has_done;
+    uint16_t done_address;
+    uint8_t done_value;
 
+    // Current step, shared with workers
+    const uint16_t *actions;
+    uint32_t frames;
+
+    pool_t pool; // Steps slices of the machines
+};
+
+uint32_t env_reward_value(const chip8_t *chip8, const env_reward_t *hook){
+    uint32_t value = 0;
+    for(uint32_t i = 0; i < hook->length; i++){
+        value = (value << 8) | chip8->ram[(hook->address + i) & RAM_MASK];
+    }
+    return value;
+}
+
+// splitmix style mix of seed, env index and episode, never 0
+uint32_t env_rng_seed(const uint64_t seed, const uint32_t index, const uint32_t episode){
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull * (((uint64_t)index << 32 | episode) + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return (uint32_t)z | 1;
+}
+
+static inline chip8_t *env_machine(const chip8_env_t *env, const uint32_t index){
+    return (chip8_t *)&env->machines.slots[(size_t)index * env->machines.stride];
+}
+
+void env_write_observation(chip8_env_t *env, const uint32_t index){
+    const chip8_t *chip8 = env_machine(env, index);
+
+    // Display rows hold pixel x at bit 63 - x: reverse the bits of each byte,
+    // then store the row most significant byte first
+    uint8_t *obs = env->observations ? &env->observations[index * CHIP8_ENV_OBS_BYTES] : NULL;
+    for(uint32_t y = 0; obs && y < 32; y++){
+        uint64_t row = chip8->display[y];
+        row = ((row >> 1) & 0x5555555555555555ull) | ((row & 0x5555555555555555ull) << 1);
+        row = ((row >> 2) & 0x3333333333333333ull) | ((row & 0x3333333333333333ull) << 2);
+        row = ((row >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((row & 0x0F0F0F0F0F0F0F0Full) << 4);
+        row = SDL_SwapBE64(row);
+        memcpy(&obs[y * 8], &row, sizeof row);
+    }
+
+    if(env->grayscale){
+        const uint32_t scale = env->config.scale_factor;
+        const uint32_t out_w = env->config.window_width * scale;
+        uint8_t *gray = &env->grayscale[(size_t)index * 64*32 * scale * scale];
+
+        for(uint32_t y = 0; y < env->config.window_height; y++){
+            uint8_t *row = &gray[y * scale * out_w];
+            for(uint32_t x = 0; x < env->config.window_width; x++){
+                memset(&row[x * scale], display_pixel(chip8->display, y * 64 + x) ? 255 : 0, scale);
             }
-            else if(chip8->inst.NN == 0xEE){
-                // 0x00EE: Return from subroutine
-                // set progrma address to last address from subroutine stack ("pop" it off the stack)
-                // so that next opcode will be gotten from address.
-                chip8->PC = *--chip8->stack_ptr;
-            }
-            else {
-                // Unimplemented invalid code, may be 0xNNN fro calling machine code routine for RCA1802
+            for(uint32_t r = 1; r < scale; r++){
+                memcpy(&row[r * out_w], row, out_w);
             }
-            break;
-        case 0x01:
-            // 0x1NNN jumps to address NNN
-            chip8->PC = chip8->inst.NNN; // Set program counter so that next opcode is from NNN
-            break;
-        case 0x02:
-            // 0x2NNN: Call subroutine at NNN
-            // Store current address to return to on subroutine stack ("push" iton the stack)
-            // and set program counter to subroutine address so that the next opcode
-            // is gotten from there.
+        }
+    }
+}
 
-            *chip8->stack_ptr++ = chip8->PC; 
-            chip8->PC = chip8->inst.NNN;
-            break;
-        case 0x03:
-            // 0x3XNN: Check if VX == NN, if so, skip the next instruction
-            if(chip8->V[chip8->inst.X] == chip8->inst.NN){
-                chip8->PC += 2; // Skip next opcode/instruction
-            } 
-            break;
-        case 0x04:
-            // 0x4XNN: Check if VX != NN, if so, skip the next instruction
-            if(chip8->V[chip8->inst.X] != chip8->inst.NN){
-                chip8->PC += 2; // Skip next opcode/instruction
-            } 
-            break;
-        case 0x05:
-            if(chip8-> inst.N != 0) break; // Wrong opcode
+void env_reset_one(chip8_env_t *env, const uint32_t index){
+    chip8_t *chip8 = env_machine(env, index);
+    copy_chip8(chip8, &env->initial);
+    chip8->rng = env_rng_seed(env->seed, index, env->episodes[index]++);
 
-            // 0x5XY0: Check if VX == VY, if so, skip the next instruction
-            if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]){
-                chip8->PC += 2; // Skip next opcode/instruction
-            } 
-            break;
-        case 0x06:
-            // 0x6XNN: Set register VX to NN
-            chip8->V[chip8->inst.X] = chip8->inst.NN;
-            break;
-        case 0x07:
-            // 0x6XNN: Set register VX += NN
-            chip8->V[chip8->inst.X] += chip8->inst.NN;
-            break;
-        case 0x08:
-            switch(chip8->inst.N){
-                case 0:
-                    // 0x8XY0: Set register VX = VY
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-                    break;
-                case 1:
-                    // 0x8XY1: Set register VX |= VY
-                    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-                    if(config.current_extension == CHIP8)
-                        chip8->V[0xF] = 0; // reset VF to 0
-                    break;
-                case 2:
-                    // 0x8XY2: Set register VX &= VY
-                    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-                    if(config.current_extension == CHIP8)
-                        chip8->V[0xF] = 0; // reset VF to 0
-                    break;
-                case 3:
-                    // 0x8XY3: Set register VX ^= VY
-                    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-                    if(config.current_extension == CHIP8)
-                        chip8->V[0xF] = 0; // reset VF to 0
-                    break;
-                case 4:
-                    // 0x8XY4: Set register VX += VY
-                    //if ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255){
-                    //    chip8->V[0xF] = 1;
-                    //}
-                    //chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+    for(uint32_t r = 0; r < env->num_rewards; r++){
+        env->reward_values[index * CHIP8_ENV_MAX_REWARDS + r] = env_reward_value(chip8, &env->reward_hooks[r]);
+    }
+}
+
+void env_step_one(chip8_env_t *env, const uint32_t index){
+    chip8_t *chip8 = env_machine(env, index);
+    const uint16_t action = env->actions ? env->actions[index] : 0;
+    for(uint32_t k = 0; k < sizeof chip8->keypad; k++){
+        chip8->keypad[k] = (action >> k) & 1;
+    }
+
+    bool done = false;
+    for(uint32_t f = 0; f < env->frames && !done; f++){
+        emulate_frame(chip8, &env->config, env->interpreter, env->cycle_interpreter);
+        done = env->has_done && chip8->ram[env->done_address & RAM_MASK] == env->done_value;
+    }
+
+    float reward = 0;
+    for(uint32_t r = 0; r < env->num_rewards; r++){
+        uint32_t *last = &env->reward_values[index * CHIP8_ENV_MAX_REWARDS + r];
+        const uint32_t value = env_reward_value(chip8, &env->reward_hooks[r]);
+        reward += env->reward_hooks[r].scale * ((float)value - (float)*last);
+        *last = value;
+    }
+    env->rewards[index] = reward;
+    env->dones[index] = done;
+
+    if(done) env_reset_one(env, index);
+    env_write_observation(env, index);
+}
+
+void env_step_slice(void *context, const uint32_t slice){
+    chip8_env_t *env = (chip8_env_t *) context;
+    const uint32_t first = (uint32_t)((uint64_t)env->num_envs * slice / env->pool.num_threads);
+    const uint32_t last = (uint32_t)((uint64_t)env->num_envs * (slice + 1) / env->pool.num_threads);
+    for(uint32_t i = first; i < last; i++){
+        env_step_one(env, i);
+    }
+}
+
+CHIP8_ENV_API chip8_env_t *chip8_env_create(const char *rom_path, uint32_t num_envs,
+                                            const chip8_env_options_t *options){
+    const chip8_env_options_t defaults = {0};
+    if(!options) options = &defaults;
+    if(num_envs == 0) return NULL;
+
+    chip8_env_t *env = calloc(1, sizeof *env);
+    if(!env) return NULL;
+
+    set_config_from_args(&env->config, 0, NULL);
+    if(options->insts_per_second) env->config.insts_per_second = options->insts_per_second;
+    env->config.current_extension = (options->extension == 1) ? SUPERCHIP :
+                                    (options->extension == 2) ? XOCHIP : CHIP8;
+    env->config.quirks = (env->config.current_extension == CHIP8) ?
+                         (QUIRK_VF_RESET | QUIRK_SHIFT_VY | QUIRK_MEMORY_INC_I) : 0;
+    env->config.scale_factor = options->grayscale_scale;
+    env->interpreter = select_interpreter(&env->config);
+    env->cycle_interpreter = select_cycle_interpreter(&env->config);
+    env->num_envs = num_envs;
+    env->seed = options->seed;
+
+    if(!init_chip8(&env->initial, &env->image, env->config, rom_path)){
+        free(env);
+        return NULL;
+    }
+
+    const size_t gray_bytes = options->grayscale_scale ?
+        (size_t)num_envs * 64*32 * options->grayscale_scale * options->grayscale_scale : 0;
+    env->episodes = calloc(num_envs, sizeof *env->episodes);
+    env->observations = options->skip_observations ? NULL : calloc(num_envs, CHIP8_ENV_OBS_BYTES);
+    env->grayscale = gray_bytes ? calloc(gray_bytes, 1) : NULL;
+    env->rewards = calloc(num_envs, sizeof *env->rewards);
+    env->dones = calloc(num_envs, sizeof *env->dones);
+    env->reward_values = calloc((size_t)num_envs * CHIP8_ENV_MAX_REWARDS, sizeof *env->reward_values);
+
+    if(!init_machine_arena(&env->machines, num_envs) || !env->episodes ||
+       (!options->skip_observations && !env->observations) || (gray_bytes && !env->grayscale) ||
+       !env->rewards || !env->dones || !env->reward_values ||
+       !init_pool(&env->pool, options->threads, num_envs, env_step_slice, env)){
+        chip8_env_destroy(env);
+        return NULL;
+    }
+
+    chip8_env_reset(env, -1);
+    return env;
+}
+
+CHIP8_ENV_API void chip8_env_destroy(chip8_env_t *env){
+    if(!env) return;
+
+    close_pool(&env->pool);
+    free(env->reward_values);
+    free(env->dones);
+    free(env->rewards);
+    free(env->grayscale);
+    free(env->observations);
+    free(env->episodes);
+    close_machine_arena(&env->machines);
+    free(env);
+}
+
+CHIP8_ENV_API void chip8_env_reset(chip8_env_t *env, int32_t index){
+    const uint32_t first = index < 0 ? 0 : (uint32_t)index;
+    const uint32_t last = index < 0 ? env->num_envs : (uint32_t)index + 1;
+    for(uint32_t i = first; i < last && i < env->num_envs; i++){
+        env_reset_one(env, i);
+        env->rewards[i] = 0;
+        env->dones[i] = 0;
+        env_write_observation(env, i);
+    }
+}
+
+CHIP8_ENV_API bool chip8_env_add_reward(chip8_env_t *env, uint16_t address, uint8_t length, float scale){
+    if(env->num_rewards == CHIP8_ENV_MAX_REWARDS || length < 1 || length > 4) return false;
+
+    const env_reward_t hook = {.address = address & 0xFFF, .length = length, .scale = scale};
+    for(uint32_t i = 0; i < env->num_envs; i++){
+        env->reward_values[i * CHIP8_ENV_MAX_REWARDS + env->num_rewards] = env_reward_value(env_machine(env, i), &hook);
+    }
+    env->reward_hooks[env->num_rewards++] = hook;
+    return true;
+}
+
+CHIP8_ENV_API void chip8_env_set_done(chip8_env_t *env, uint16_t address, uint8_t value){
+    env->has_done = true;
+    env->done_address = address & 0xFFF;
+    env->done_value = value;
+}
+
+CHIP8_ENV_API void chip8_env_step(chip8_env_t *env, const uint16_t *actions, uint32_t frames){
+    env->actions = actions;
+    env->frames = frames;
+    pool_run(&env->pool);
+}
+
+CHIP8_ENV_API const uint8_t *chip8_env_observations(const chip8_env_t *env){
+    return env->observations;
+}
+
+CHIP8_ENV_API const uint64_t *chip8_env_display(const chip8_env_t *env, uint32_t index){
+    return env_machine(env, index)->display;
+}
 
-                    carry = ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255);
-                    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-                    chip8->V[0xF] = carry;
+CHIP8_ENV_API size_t chip8_env_display_stride(const chip8_env_t *env){
+    return env->machines.stride;
+}
 
-                    break;
-                case 5:
-                    // 0x8XY5: Set register VX -= VY
-                    //if (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]){
-                    //    chip8->V[0xF] = 1;
-                    //}
+CHIP8_ENV_API const uint8_t *chip8_env_grayscale(const chip8_env_t *env){
+    return env->grayscale;
+}
 
-                    carry = (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]);
-                    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+CHIP8_ENV_API const float *chip8_env_rewards(const chip8_env_t *env){
+    return env->rewards;
+}
 
-                    chip8->V[0xF] = carry;
-                    break;
-                case 6:
-                    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-                    
-                    if(config.current_extension == CHIP8){
-                        carry = chip8->V[chip8->inst.Y] & 1;
-                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
-                    }
-                    else{
-                        carry = chip8->V[chip8->inst.X] & 1;
-                        chip8->V[chip8->inst.X] >>= 1;
-                    }
+CHIP8_ENV_API const uint8_t *chip8_env_dones(const chip8_env_t *env){
+    return env->dones;
+}
 
-                    chip8->V[0xF] = carry;
-                    break;
-                case 7:
-                    // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive)
-                    //if (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]){
-                    //    chip8->V[0xF] = 1;
-                    //}
+CHIP8_ENV_API const uint8_t *chip8_env_ram(const chip8_env_t *env, uint32_t index){
+    return env_machine(env, index)->ram;
+}
+#endif
 
-                    carry = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-                    chip8->V[0xF] = carry;
-                    break;
-                case 0xE:
-                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-                    if(config.current_extension == CHIP8){
-                        carry = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
-                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
-                    }
-                    else{
-                        carry = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-                        chip8->V[chip8->inst.X] <<= 1;
-                    }
+#ifdef CHIP8_FUZZ
+// In-process fuzz target, built with make fuzz (libFuzzer) or make fuzz-driver.
+//
+// Input layout:
+//   byte 0          quirk bits (QUIRK_*) in the low nibble, frames to run - 1 in the high nibble
+//   byte 1          n, number of keypad masks
+//   2n bytes        keypad bitmask per frame, big endian, cycled through
+//   rest            ROM image loaded at 0x200
+//
+// The budget is part of the input so the fuzzer trades run length against
+// executions per second itself, at most 16 frames of 64 instructions.
 
-                    chip8->V[0xF] = carry;
-                    break;
-                default:
-                    // Wrong/unimplemented opcode
-                    break;
-            }
-            break;
-        case 0x09:
-            // 0x9XY0: Skip next instruction if VX != VY
-            if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]){
-                chip8->PC += 2;
+#define FUZZ_FRAME_INSTS 64 // Instructions per frame
+
+// Opcode classes for coverage reporting
+static const char *fuzz_opcode_names[] = {
+    "00E0", "00EE", "0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0",
+    "6XNN", "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5",
+    "8XY6", "8XY7", "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN",
+    "EX9E", "EXA1", "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29",
+    "FX33", "FX55", "FX65", "invalid",
+};
+#define FUZZ_OPCODE_CLASSES (sizeof fuzz_opcode_names / sizeof fuzz_opcode_names[0])
+
+static uint64_t fuzz_opcode_counts[FUZZ_OPCODE_CLASSES]; // Executions per class, all inputs
+static uint64_t fuzz_executions;
+static bool fuzz_check_fusion; // -fusion_check=1: also run every input fused and compare
+static violations_t fuzz_violations; // Summed over all inputs
+
+uint32_t fuzz_opcode_class(const uint16_t opcode){
+    const uint8_t NN = opcode & 0xFF;
+    const uint8_t N = opcode & 0xF;
+    const uint32_t invalid = FUZZ_OPCODE_CLASSES - 1;
+
+    switch(opcode >> 12){
+        case 0x0: return opcode == 0x00E0 ? 0 : opcode == 0x00EE ? 1 : 2;
+        case 0x5: return N == 0 ? 7 : invalid;
+        case 0x8:
+            if(N <= 7) return 10 + N;
+            return N == 0xE ? 18 : invalid;
+        case 0x9: return 19;
+        case 0xE: return NN == 0x9E ? 24 : NN == 0xA1 ? 25 : invalid;
+        case 0xF:
+            switch(NN){
+                case 0x07: return 26;
+                case 0x0A: return 27;
+                case 0x15: return 28;
+                case 0x18: return 29;
+                case 0x1E: return 30;
+                case 0x29: return 31;
+                case 0x33: return 32;
+                case 0x55: return 33;
+                case 0x65: return 34;
+                default: return invalid;
             }
-            break;
-        case 0x0A:
-            // 0xANNN: Set I to NNN
-            chip8->I = chip8->inst.NNN;
-            break;
-        case 0x0B:
-            // 0xBNNN: Jump to address v0 + NNN
-            chip8->PC = chip8->V[0] + chip8->inst.NNN;
+        default: {
+            // 1-4, 6, 7, A-D map straight to their class
+            static const uint8_t classes[16] = {
+                [0x1] = 3, [0x2] = 4, [0x3] = 5, [0x4] = 6, [0x6] = 8, [0x7] = 9,
+                [0xA] = 20, [0xB] = 21, [0xC] = 22, [0xD] = 23,
+            };
+            return classes[opcode >> 12];
+        }
+    }
+}
 
-            break;
-        case 0x0C:
-            // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
-            chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
+#define FUZZ_COVERAGE_BYTES ((FUZZ_OPCODE_CLASSES * FUZZ_OPCODE_CLASSES + 7) / 8)
 
-            break;
-        case 0x0D:
-            // 0xDXYN: Draw N height sprite coors X, Y; Read from memory location I;
-            // Screen pixels are XOR'd with sprite bits,
-            // VF (Carry flag) is set if any screen pixels are set off; this is usefull
-            // for collision detection or other reasons.
+static uint8_t fuzz_classes[0x10000]; // fuzz_opcode_class() of every opcode
+static uint8_t fuzz_no_coverage[FUZZ_COVERAGE_BYTES]; // Written and ignored when coverage isn't collected
+static uint8_t *fuzz_coverage = fuzz_no_coverage;
+static uint32_t fuzz_prev_class;
 
-            uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-            uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-            const uint8_t orig_X = X_coord; // Original X Value
-            chip8->V[0xF] = 0; // Initialize carry flag to 0
-
-            // Loop over all N rows of the sprite
-            for(uint8_t i = 0; i < chip8->inst.N; i++){
-                // Get next byte/row of sprite data
-                const uint8_t sprite_data = chip8->ram[chip8->I + i];
-                X_coord = orig_X; // Reste X for next row to draw
-
-                for(int8_t j = 7; j >= 0; j--){
-                    // If sprite pixek/bit is on and display pixel is on, set carry flag
-                    //bool *pixel = &chip8->display[Y_coord * config.window_height + X_coord];
-                    bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-                    const bool sprite_bit = (sprite_data & (1 << j));
-                    if(sprite_bit && *pixel){
-                        chip8->V[0xF] = 1;
-                    }
+// After every instruction of the plain interpreters, so frames run in one
+// call and coverage still sees each instruction
+void fuzz_trace(const uint16_t opcode){
+    const uint32_t class = fuzz_classes[opcode];
+    const uint32_t edge = fuzz_prev_class * FUZZ_OPCODE_CLASSES + class;
+    fuzz_opcode_counts[class]++;
+    fuzz_coverage[edge / 8] |= 1 << (edge % 8);
+    fuzz_prev_class = class;
+}
 
-                    // XOR display pixel with sprite pixel/bit to on or off
-                   *pixel ^= sprite_bit;
+// Run one input on a static machine; reset reuses it, nothing is allocated.
+// If coverage is not NULL, sets a bit per (previous class, class) transition.
+void fuzz_run(const uint8_t *data, const size_t size, uint8_t *coverage){
+    static chip8_t chip8;
+    static chip8_t fused; // Same input run a frame at a time with fusion, must stay identical
+    static rom_image_t image;
+    static bool image_loaded;
+    static config_t config;
+    static interpreter_t interpreters[1 << QUIRK_COUNT];
+    static interpreter_t fused_interpreters[1 << QUIRK_COUNT];
 
-                   // Stop drawing if hit right edge of screen
-                    if(++X_coord >= config.window_width) break;
-                }
-                if(++Y_coord >= config.window_height) break;
-            }
-            chip8->draw = true; // Will update screen on next 60 hz tick
-            break;
-        case 0x0E:
-            if(chip8->inst.NN == 0x9E){
-                // 0xEX9E: Skip next instruction if key in VX is pressed
-                if(chip8->keypad[chip8->V[chip8->inst.X]] == true)
-                    chip8->PC += 2;
-            }
-            else if(chip8->inst.NN == 0xA1){
-                if(!chip8->keypad[chip8->V[chip8->inst.X]])
-                    chip8->PC += 2;
+    if(!interpreters[0]){
+        set_config_from_args(&config, 0, NULL);
+        for(uint32_t q = 0; q < (1 << QUIRK_COUNT); q++){
+            config.quirks = q;
+            config.fusion = false;
+            interpreters[q] = select_interpreter(&config);
+            config.fusion = true;
+            fused_interpreters[q] = select_interpreter(&config);
+        }
+        for(uint32_t op = 0; op < 0x10000; op++) fuzz_classes[op] = fuzz_opcode_class(op);
+    }
+
+    if(size < 2) return;
+    config.quirks = data[0] & ((1 << QUIRK_COUNT) - 1);
+    const uint32_t frames = 1 + (data[0] >> 4);
+    const uint32_t num_masks = data[1];
+    if(size < 2 + 2 * (size_t)num_masks) return;
+    const uint8_t *masks = &data[2];
+    const uint8_t *rom = &data[2 + 2 * num_masks];
+    const size_t rom_size = size - 2 - 2 * num_masks;
+
+    // The image, and its fusion analysis when fusion is checked, is only built
+    // again when the ROM or quirks differ from the previous input's
+    config.fusion = fuzz_check_fusion;
+    if(!image_loaded || image.rom_size != rom_size || image.quirks != config.quirks ||
+       image.fusion != config.fusion || memcmp(&image.ram[0x200], rom, rom_size) != 0){
+        image_loaded = load_rom_image(&image, &config, rom, rom_size);
+        if(!image_loaded) return;
+    }
+    reset_chip8(&chip8, config, &image);
+    chip8.rng = 1; // Deterministic per input
+    if(fuzz_check_fusion) copy_chip8(&fused, &chip8);
+    fuzz_executions++;
+
+    const interpreter_t interpreter = interpreters[config.quirks];
+    fuzz_coverage = coverage ? coverage : fuzz_no_coverage;
+    fuzz_prev_class = 0;
+    for(uint32_t f = 0; f < frames; f++){
+        if(num_masks){
+            const uint32_t m = f % num_masks;
+            const uint16_t keys = (masks[2 * m] << 8) | masks[2 * m + 1];
+            for(uint32_t k = 0; k < sizeof chip8.keypad; k++){
+                chip8.keypad[k] = (keys >> k) & 1;
             }
-            break;
-        case 0x0F:
-            switch(chip8->inst.NN){
-                case 0x0A:
-                    // 0xFX0A: VX = get_key(): Await until a keypress, an store in VX
-                    static bool any_key_pressed = false;
-                    static uint8_t key = 0xFF;
-                    for(uint8_t i = 0; key == 0xFF && i < sizeof chip8->keypad; i++){
-                        if(chip8->keypad[i]){
-                            key = i;
-                            //chip8->V[chip8->inst.X] = i; // i = key (offset into keypad array)
-                            any_key_pressed = true;
-                            break;
-                        }
-                    }
+            if(fuzz_check_fusion) memcpy(fused.keypad, chip8.keypad, sizeof fused.keypad);
+        }
 
-                    // Keep gettinh the current opcode nad running this instruction
-                    if(!any_key_pressed){
-                        chip8->PC -= 2;
-                    }
-                    else{
-                        if(chip8->keypad[key]){
-                            chip8->PC -= 2; 
-                        }
-                        else{
-                            // A key has been pressed, also wait until it is released
-                            chip8->V[chip8->inst.X] = key;
-                            key = 0xFF;
-                            any_key_pressed = false;
-                        }
-                    }
+        interpreter(&chip8, &config, FUZZ_FRAME_INSTS); // Stops early on a vblank wait, like emulate_frame()
+        tick_timers(&chip8);
+        if(!fuzz_check_fusion) continue;
 
-                    break;
+        fused_interpreters[config.quirks](&fused, &config, FUZZ_FRAME_INSTS);
+        tick_timers(&fused);
+        if(memcmp(&fused, &chip8, sizeof chip8) != 0){
+            fprintf(stderr, "Fused interpreter diverged in frame %u\n", (unsigned)f);
+            abort();
+        }
+    }
 
-                case 0x1E:
-                    // 0xFX1E: I += VX; Add VX to register I. For non-Aniga CHIP8, does not affect VF
-                    chip8->I += chip8->V[chip8->inst.X];
-                    break;
-                case 0x07:
-                    // 0xFX07: Set VX to delay timer value
-                    chip8->V[chip8->inst.X] = chip8->delay_timer;
-                    break;
-                case 0x15:
-                    // 0xFX15: Set delay timer to VX
-                    chip8->delay_timer = chip8->V[chip8->inst.X];
-                    break;
-                case 0x18:
-                    // 0xFX18: Set sound timer to VX
-                    chip8->sound_timer = chip8->V[chip8->inst.X];
-                    break;
-                case 0x29:
-                    // 0xFX29: Set register I to location of sprite for digit VX
-                    chip8->I = chip8->V[chip8->inst.X] * 5; // Each sprite is 5 bytes long
-                    break;
-                case 0x33:
-                    // 0xFX33: Store BCD representation of VX in memory locations I, I+1, I+2
-                    uint8_t bcd = chip8->V[chip8->inst.X];
-                    chip8->ram[chip8->I + 2] = bcd % 10;
-                    bcd /= 10;
-                    chip8->ram[chip8->I + 1] = bcd % 10;
-                    bcd /= 10;
-                    chip8->ram[chip8->I] = bcd;
-                    break;
-                case 0x55:
-                    // 0xFX55: Store V0 to VX in memory starting at I
-                    // NOTE: Could make this a config flag to use SCHHIP or CHIP8 behavior for I
-                    for(uint8_t i = 0; i <= chip8->inst.X; i++){
-                        if(config.current_extension == CHIP8){
-                            chip8->ram[chip8->I++] = chip8->V[i];
-                        }
-                        else{
-                            chip8->ram[chip8->I + i] = chip8->V[i];
-                        }
-                    }
-                    break;
-                case 0x65:
-                    // 0xFX65: Fill V0 to VX with values from memory starting at I
-                    // NOTE: Could make this a config flag to use SCHHIP or CHIP8 behavior for I
-                    for(uint8_t i = 0; i <= chip8->inst.X; i++){
+    fuzz_violations.ram += chip8.violations.ram;
+    fuzz_violations.stack_overflow += chip8.violations.stack_overflow;
+    fuzz_violations.stack_underflow += chip8.violations.stack_underflow;
+    fuzz_violations.keypad += chip8.violations.keypad;
+}
 
-                        if(config.current_extension == CHIP8){
-                            chip8->V[i] = chip8->ram[chip8->I++];
-                        }
-                        else{
-                            chip8->V[i] = chip8->ram[chip8->I + i];
-                        }
-                    }
-                    break;
-                default:
-                    // Wrong/unimplemented opcode
-                    break;
-            }
-            break;
-        default:
-            break;
+void print_fuzz_coverage(void){
+    uint32_t hit = 0;
+    for(uint32_t c = 0; c < FUZZ_OPCODE_CLASSES; c++) hit += fuzz_opcode_counts[c] > 0;
+
+    printf("Opcode coverage over %llu executions: %u/%u classes\n",
+           (long long unsigned)fuzz_executions, (unsigned)hit, (unsigned)FUZZ_OPCODE_CLASSES);
+    for(uint32_t c = 0; c < FUZZ_OPCODE_CLASSES; c++){
+        printf("  %-8s %llu\n", fuzz_opcode_names[c], (long long unsigned)fuzz_opcode_counts[c]);
     }
+    printf("Violations: %u RAM, %u stack overflow, %u stack underflow, %u keypad\n",
+           (unsigned)fuzz_violations.ram, (unsigned)fuzz_violations.stack_overflow,
+           (unsigned)fuzz_violations.stack_underflow, (unsigned)fuzz_violations.keypad);
 }
 
-void update_timers(const sdl_t sdl, chip8_t *chip8){
-    if(chip8->delay_timer > 0){
-        chip8->delay_timer--;
+int LLVMFuzzerInitialize(int *argc, char ***argv){
+    // libFuzzer ignores flags it does not know, -fusion_check=1 is ours
+    for(int i = 1; i < *argc; i++){
+        if(strcmp((*argv)[i], "-fusion_check=1") == 0) fuzz_check_fusion = true;
     }
+    atexit(print_fuzz_coverage);
+    return 0;
+}
 
-    if(chip8->sound_timer > 0){
-        chip8->sound_timer--;
-        SDL_PauseAudioDevice(sdl.dev, 0); // Play sound
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    fuzz_run(data, size, NULL);
+    return 0;
+}
+
+#ifdef CHIP8_FUZZ_DRIVER
+// Standalone driver without libFuzzer:
+//   chip8_fuzz [-runs=N] [-seed=S] [-fusion_check=1] [files...]
+// Runs each file once, then mutates the corpus for N runs (default 100000,
+// 0 when files are given), keeping inputs that reach new opcode class
+// transitions.
+
+#define FUZZ_MAX_INPUT 4096
+#define FUZZ_MAX_CORPUS 1024
+
+typedef struct {
+    uint8_t data[FUZZ_MAX_INPUT];
+    size_t size;
+} fuzz_input_t;
+
+static fuzz_input_t fuzz_corpus[FUZZ_MAX_CORPUS];
+static uint32_t fuzz_corpus_size;
+static uint8_t fuzz_seen[FUZZ_COVERAGE_BYTES];
+
+// Run input, add it to the corpus if it covers anything new
+bool fuzz_try(const uint8_t *data, const size_t size){
+    uint8_t coverage[FUZZ_COVERAGE_BYTES] = {0};
+    fuzz_run(data, size, coverage);
+
+    bool new_coverage = false;
+    for(uint32_t i = 0; i < FUZZ_COVERAGE_BYTES; i++){
+        if(coverage[i] & ~fuzz_seen[i]) new_coverage = true;
+        fuzz_seen[i] |= coverage[i];
     }
-    else{
-        SDL_PauseAudioDevice(sdl.dev, 1); // Stop sound
+
+    if(new_coverage && fuzz_corpus_size < FUZZ_MAX_CORPUS){
+        fuzz_input_t *input = &fuzz_corpus[fuzz_corpus_size++];
+        memcpy(input->data, data, size);
+        input->size = size;
     }
+    return new_coverage;
 }
 
-// Main function
-int main(int argc, char **argv){
-    // Default Usage message for args
-    if(argc < 2){
-        fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
+static uint64_t fuzz_rng_state;
+uint32_t fuzz_rng(void){
+    fuzz_rng_state = fuzz_rng_state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(fuzz_rng_state >> 33);
+}
 
-    //puts("TESTING CHIP 8");
+void fuzz_mutate(fuzz_input_t *input){
+    const uint32_t mutations = 1 + fuzz_rng() % 8;
+    for(uint32_t m = 0; m < mutations; m++){
+        switch(fuzz_rng() % 4){
+            case 0: // Flip a bit
+                if(input->size) input->data[fuzz_rng() % input->size] ^= 1 << (fuzz_rng() % 8);
+                break;
+            case 1: // Random byte
+                if(input->size) input->data[fuzz_rng() % input->size] = fuzz_rng();
+                break;
+            case 2: // Append random opcode
+                if(input->size + 2 <= FUZZ_MAX_INPUT){
+                    input->data[input->size++] = fuzz_rng();
+                    input->data[input->size++] = fuzz_rng();
+                }
+                break;
+            case 3: // Truncate
+                if(input->size > 2) input->size -= fuzz_rng() % (input->size / 2 + 1);
+                break;
+        }
+    }
+}
 
-    // Init emulator configuration
-    config_t config = {0};
-    if(!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
+int main(int argc, char **argv){
+    int64_t runs = -1;
+    fuzz_rng_state = 1;
 
-    const char *rom_name = argv[1];
+    for(int i = 1; i < argc; i++){
+        if(strncmp(argv[i], "-runs=", strlen("-runs=")) == 0){
+            runs = strtoll(argv[i] + strlen("-runs="), NULL, 10);
+        }
+        else if(strncmp(argv[i], "-seed=", strlen("-seed=")) == 0){
+            fuzz_rng_state = strtoull(argv[i] + strlen("-seed="), NULL, 10);
+        }
+        else if(strncmp(argv[i], "-fusion_check=", strlen("-fusion_check=")) == 0){
+            fuzz_check_fusion = strtol(argv[i] + strlen("-fusion_check="), NULL, 10) != 0;
+        }
+        else{
+            static uint8_t data[FUZZ_MAX_INPUT];
+            FILE *file = fopen(argv[i], "rb");
+            if(!file){
+                fprintf(stderr, "Could not open %s\n", argv[i]);
+                continue;
+            }
+            const size_t size = fread(data, 1, sizeof data, file);
+            fclose(file);
+            fuzz_try(data, size);
+            if(runs < 0) runs = 0;
+        }
+    }
+    if(runs < 0) runs = 100000;
 
-    // Initialize SDL
-    sdl_t sdl = {0};
-    if(!init_sdl(&sdl, &config, rom_name)) exit(EXIT_FAILURE);
+    // Start from an empty program if no inputs were given
+    if(fuzz_corpus_size == 0){
+        const uint8_t empty[] = {0x07, 0x00, 0x00, 0xE0};
+        fuzz_try(empty, sizeof empty);
+    }
 
-    // Initialize CHIP8 machine
-    chip8_t chip8 = {0};
-    
-    if(!init_chip8(&chip8, config, rom_name)) exit(EXIT_FAILURE);
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for(int64_t r = 0; r < runs; r++){
+        fuzz_input_t input = fuzz_corpus[fuzz_rng() % fuzz_corpus_size];
+        fuzz_mutate(&input);
+        fuzz_try(input.data, input.size);
+    }
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-    // Initial screen clear
-    clear_screen(sdl, config);
+    if(runs) printf("%lld runs in %.2f s (%.0f executions/s), corpus %u inputs\n",
+           (long long)runs, seconds, runs / seconds, (unsigned)fuzz_corpus_size);
+    print_fuzz_coverage();
+    return 0;
+}
+#endif
+#endif
 
-    // Seed random number generator
-    srand(time(NULL));
-    
-    // Main emulator loop
-    while(chip8.state != QUIT){
-        // Handle user input
-        handle_input(&chip8, &config);
+#ifdef CHIP8_TEST
+// Self checks of the emulator core, built and run with make check
 
-        if(chip8.state == PAUSED) continue;
+// A DXYN display wait whose cost lands exactly on a vblank has reached it,
+// instead of idling a whole extra frame
+bool test_vip_wait(void){
+    static const uint8_t rom[] = {0xD0, 0x11};
+    static rom_image_t image;
+    static chip8_t chip8;
+    config_t config = {0};
+    set_config_from_args(&config, 0, NULL);
 
-        // get time before running instructions
-        const uint64_t start_frame_time = SDL_GetPerformanceCounter();
+    config.fusion = false;
+    config.quirks = 0;
+    if(!load_rom_image(&image, &config, rom, sizeof rom)) return false;
+    reset_chip8(&chip8, config, &image);
+    select_cycle_interpreter(&config)(&chip8, &config, 1); // Just the DXYN, for its cost
+    const uint64_t cost = chip8.cycles;
 
-        // Get_time();
+    config.quirks = QUIRK_DISPLAY_WAIT;
+    if(!load_rom_image(&image, &config, rom, sizeof rom)) return false;
+    reset_chip8(&chip8, config, &image);
+    chip8.cycles = 2 * VIP_CYCLES_PER_FRAME - cost;
+    select_cycle_interpreter(&config)(&chip8, &config, 2 * VIP_CYCLES_PER_FRAME);
+    if(chip8.cycles != 2 * VIP_CYCLES_PER_FRAME){
+        fprintf(stderr, "Display wait ending on a vblank ran to cycle %llu, not %u\n",
+                (long long unsigned)chip8.cycles, 2 * VIP_CYCLES_PER_FRAME);
+        return false;
+    }
+    return true;
+}
 
-        // Emulate CHIP8 Instructions for this emulator "frame" (60 hz)
-        for(uint32_t i = 0; i < config.insts_per_second / 60; i++){
-            emulate_instructions(&chip8, config);
-        }
+// Fusible sequences, each with the address its fused operation must start at
+static const struct {
+    const char *name;
+    uint16_t fused_at;
+    uint16_t program[16];
+} test_fusion_programs[] = {
+    // ANNN+DXYN moving a sprite right
+    {"load_draw", 0x200, {0xA000, 0xD015, 0x7005, 0x1200}},
+    // 6XNN/7XNN chain, cut short by small budgets
+    {"set_chain", 0x200, {0x6005, 0x6107, 0x7003, 0x7102, 0x6233, 0x7201, 0x1200}},
+    // 3XNN and 4XNN skipping a jump, or taking it
+    {"skip_jump", 0x202, {0x7001, 0x3008, 0x1200, 0x7101, 0x4103, 0x120E, 0x6100, 0x6000, 0x1200}},
+    // FX1E+FY65 loading from a moving index
+    {"index_load", 0x204, {0xA220, 0x7501, 0xF51E, 0xF365, 0x1200}},
+    // FX07/3X00/1NNN waiting out the delay timer
+    {"delay_poll", 0x204, {0x6203, 0xF215, 0xF307, 0x3300, 0x1204, 0x7401, 0x1200}},
+    // FX55 writes 00EE over the second instruction of a fused chain in a
+    // subroutine, the next call must return there instead of running the chain
+    {"self_modify", 0x212, {0x2212, 0x6000, 0x61EE, 0x6200, 0xA214, 0xF155, 0x2212, 0x7E01,
+                            0x120E, 0x6001, 0x6102, 0x6203, 0x00EE}},
+};
 
-        // get time elapsed since running instructions
-        const uint64_t end_frame_time = SDL_GetPerformanceCounter();
+// Fused and plain interpreters leave identical machines, for every quirk set
+// and instruction budget, frame after frame
+bool test_fusion(void){
+    static rom_image_t image;
+    static chip8_t plain, fused;
+    config_t config = {0};
+    set_config_from_args(&config, 0, NULL);
 
-        // Emulate CHIP8 instructions
-        // Get_time(); elapsed since last get_time();
+    static const uint32_t budgets[] = {1, 2, 3, 7, 64};
+    for(uint32_t p = 0; p < sizeof test_fusion_programs / sizeof test_fusion_programs[0]; p++){
+        uint8_t rom[sizeof test_fusion_programs[p].program];
+        for(uint32_t i = 0; i < sizeof rom / 2; i++){
+            rom[2 * i] = test_fusion_programs[p].program[i] >> 8;
+            rom[2 * i + 1] = test_fusion_programs[p].program[i] & 0xFF;
+        }
 
-        // Delay for 60hz
-        const double time_elapsed = (double)((end_frame_time - start_frame_time) * 1000) / SDL_GetPerformanceFrequency();
-        SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
+        for(uint32_t q = 0; q < (1 << QUIRK_COUNT); q++){
+            config.quirks = q;
+            config.fusion = false;
+            const interpreter_t plain_interpreter = select_interpreter(&config);
+            config.fusion = true;
+            const interpreter_t fused_interpreter = select_interpreter(&config);
+            if(!load_rom_image(&image, &config, rom, sizeof rom)) return false;
+            if(!image.fused[test_fusion_programs[p].fused_at]){
+                fprintf(stderr, "%s: nothing fused at 0x%03X\n", test_fusion_programs[p].name,
+                        (unsigned)test_fusion_programs[p].fused_at);
+                return false;
+            }
 
-        //if(chip8.draw){
-            update_screen(sdl, config, &chip8);
-            //chip8.draw = false;
-        //}
-        
-        // Update delays and sound timers
-        update_timers(sdl, &chip8);
+            for(uint32_t b = 0; b < sizeof budgets / sizeof budgets[0]; b++){
+                reset_chip8(&plain, config, &image);
+                plain.rng = 1;
+                copy_chip8(&fused, &plain);
+                for(uint32_t f = 0; f < 32; f++){
+                    plain_interpreter(&plain, &config, budgets[b]);
+                    tick_timers(&plain);
+                    fused_interpreter(&fused, &config, budgets[b]);
+                    tick_timers(&fused);
+                    if(memcmp(&plain, &fused, sizeof plain) != 0){
+                        fprintf(stderr, "%s: fused machine diverged with quirks %u, %u instructions a frame, "
+                                "frame %u\n", test_fusion_programs[p].name, (unsigned)q,
+                                (unsigned)budgets[b], (unsigned)f);
+                        return false;
+                    }
+                }
+            }
+        }
     }
+    return true;
+}
 
-    // Final cleanup
-    final_cleanup(sdl);
+int main(void){
+    static const struct {
+        const char *name;
+        bool (*run)(void);
+    } tests[] = {
+        {"vip_wait", test_vip_wait},
+        {"fusion", test_fusion},
+    };
 
-    exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+    uint32_t failed = 0;
+    for(uint32_t t = 0; t < sizeof tests / sizeof tests[0]; t++){
+        const bool passed = tests[t].run();
+        printf("%-24s %s\n", tests[t].name, passed ? "ok" : "FAILED");
+        failed += !passed;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
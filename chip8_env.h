@@ -0,0 +1,78 @@
+// Batched CHIP8 environment API, built as a shared library with "make lib".
+//
+// One ROM, many machines stepped together on a thread pool. Observations,
+// rewards and done flags live in contiguous buffers owned by the environment;
+// the pointers returned below stay valid until chip8_env_destroy() and are
+// rewritten in place by every chip8_env_step().
+//
+// The packed observations are a copy. For zero-copy reads, chip8_env_display()
+// points straight at a machine's display rows, which every machine keeps at a
+// fixed stride in one arena; skip_observations then drops the copy.
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define CHIP8_ENV_API __declspec(dllexport)
+#else
+#define CHIP8_ENV_API __attribute__((visibility("default")))
+#endif
+
+// Packed display bits per environment: 32 rows of 8 bytes, pixel x of a row
+// is bit (x % 8) of byte (x / 8)
+#define CHIP8_ENV_OBS_BYTES (64 * 32 / 8)
+
+#define CHIP8_ENV_MAX_REWARDS 8 // Reward hooks per environment
+
+typedef struct chip8_env chip8_env_t;
+
+typedef struct {
+    uint32_t insts_per_second; // CPU clock, 0 = 700
+    int32_t extension; // 0 = CHIP8, 1 = SUPERCHIP, 2 = XOCHIP
+    uint32_t grayscale_scale; // Also render (64*s)x(32*s) 8-bit grayscale observations, 0 = off
+    uint32_t threads; // Worker threads including the caller, 0 = one per CPU
+    uint64_t seed; // Seed for each machine's CXNN random state
+    bool skip_observations; // Don't write packed observations, read chip8_env_display() instead
+} chip8_env_options_t;
+
+// Create num_envs machines running rom_path. options may be NULL for defaults.
+// Returns NULL on failure.
+CHIP8_ENV_API chip8_env_t *chip8_env_create(const char *rom_path, uint32_t num_envs,
+                                            const chip8_env_options_t *options);
+CHIP8_ENV_API void chip8_env_destroy(chip8_env_t *env);
+
+// Reset one environment, or all of them when index < 0
+CHIP8_ENV_API void chip8_env_reset(chip8_env_t *env, int32_t index);
+
+// Reward hook: reward += scale * (value now - value at previous step), value
+// being the big-endian number in the length (1-4) bytes of RAM at address.
+// Returns false when CHIP8_ENV_MAX_REWARDS hooks are already set.
+CHIP8_ENV_API bool chip8_env_add_reward(chip8_env_t *env, uint16_t address, uint8_t length, float scale);
+
+// Episode ends when RAM at address equals value; the environment reports
+// done for that step and is reset automatically.
+CHIP8_ENV_API void chip8_env_set_done(chip8_env_t *env, uint16_t address, uint8_t value);
+
+// Hold keypad bitmask actions[i] (bit k = key k) on environment i and
+// emulate frames 60hz frames on every environment. actions may be NULL.
+CHIP8_ENV_API void chip8_env_step(chip8_env_t *env, const uint16_t *actions, uint32_t frames);
+
+// num_envs * CHIP8_ENV_OBS_BYTES packed display bits, NULL with skip_observations
+CHIP8_ENV_API const uint8_t *chip8_env_observations(const chip8_env_t *env);
+// Environment index's live display, no copy: 32 rows, pixel x of a row is
+// bit 63 - x. Environment i's rows are i * chip8_env_display_stride() bytes
+// after environment 0's, so all of them can be viewed as one strided array.
+CHIP8_ENV_API const uint64_t *chip8_env_display(const chip8_env_t *env, uint32_t index);
+CHIP8_ENV_API size_t chip8_env_display_stride(const chip8_env_t *env);
+// num_envs * (64*s)*(32*s) bytes, 0 or 255, NULL unless grayscale_scale was set
+CHIP8_ENV_API const uint8_t *chip8_env_grayscale(const chip8_env_t *env);
+// num_envs rewards and done flags from the last step
+CHIP8_ENV_API const float *chip8_env_rewards(const chip8_env_t *env);
+CHIP8_ENV_API const uint8_t *chip8_env_dones(const chip8_env_t *env);
+// Direct read access to environment index's 4096 bytes of RAM
+CHIP8_ENV_API const uint8_t *chip8_env_ram(const chip8_env_t *env, uint32_t index);
+
+#endif
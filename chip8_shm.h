@@ -0,0 +1,67 @@
+// Shared memory layout published by "chip8.out <rom> --shm <name>" (POSIX only).
+//
+// The emulator writes machine state once per frame under a seqlock and never
+// waits for readers. Readers map the segment read/write (shm_open(name,
+// O_RDWR) + mmap) and read frames in place:
+//
+//     uint32_t seq;
+//     do {
+//         seq = chip8_shm_read_begin(shm);
+//         ... read display/pixel_color/registers directly from shm ...
+//     } while(chip8_shm_read_retry(shm, seq));
+//
+// Input goes the other way: write keys, then chip8_shm_send_keys() bumps
+// input_seq and the emulator copies keys into its keypad on the next frame.
+#ifndef CHIP8_SHM_H
+#define CHIP8_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CHIP8_SHM_MAGIC 0x38504843 // "CHP8"
+#define CHIP8_SHM_VERSION 1
+
+typedef struct {
+    uint32_t magic; // CHIP8_SHM_MAGIC once the emulator has initialized the segment
+    uint32_t version; // CHIP8_SHM_VERSION
+
+    // Emulator -> readers, valid while seq is even and unchanged
+    uint32_t seq; // Seqlock sequence, odd while a frame is being written
+    uint32_t frame; // Frame number, increments every published frame
+    uint32_t pixel_color[64*32]; // RGBA8888 colors as drawn
+    uint8_t display[64*32]; // 1 = pixel on
+    uint16_t stack[16]; // Subroutine stack ring, top entry at (sp - 1) % 16
+    uint16_t I; // Index register
+    uint16_t PC; // Program counter
+    uint8_t V[16]; // Data registers V0-VF
+    uint8_t sp; // Stack depth, past 16 the oldest entries have been overwritten
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t padding;
+
+    // Readers -> emulator
+    uint32_t input_seq; // Bump after writing keys, see chip8_shm_send_keys()
+    uint16_t keys; // Keypad bitmask, bit k = key k held
+    uint16_t padding2;
+} chip8_shm_t;
+
+static inline uint32_t chip8_shm_read_begin(const chip8_shm_t *shm){
+    uint32_t seq;
+    while((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1){
+        // Frame being written, spin
+    }
+    return seq;
+}
+
+// True if the frame changed while it was being read and must be read again
+static inline bool chip8_shm_read_retry(const chip8_shm_t *shm, const uint32_t seq){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void chip8_shm_send_keys(chip8_shm_t *shm, const uint16_t keys){
+    __atomic_store_n(&shm->keys, keys, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shm->input_seq, 1, __ATOMIC_RELEASE);
+}
+
+#endif